@@ -30,10 +30,34 @@ pub fn build(b: *std.Build) void {
         .flags = &.{"-fno-exceptions"},
     });
     pthread.root_module.addCMacro("_GNU_SOURCE", "1");
+    pthread.addIncludePath(b.path("libstdc++_standalone/include"));
     pthread.linkSystemLibrary("dl");
     pthread.linkSystemLibrary("pthread");
     b.installArtifact(pthread);
 
+    const pthread_bench = b.addExecutable(.{
+        .name = "pthread_bio_bench",
+        .root_module = b.createModule(.{
+            .target = target,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    pthread_bench.addCSourceFile(.{
+        .file = b.path("pthread_wrapper/bench.c"),
+        .flags = &.{},
+    });
+    pthread_bench.root_module.addCMacro("_GNU_SOURCE", "1");
+    pthread_bench.linkLibrary(pthread);
+    pthread_bench.linkSystemLibrary("pthread");
+
+    const run_pthread_bench = b.addRunArtifact(pthread_bench);
+    if (b.args) |args| {
+        run_pthread_bench.addArgs(args);
+    }
+    const bench_step = b.step("bench", "Compare libpthread_bio's primitives with the host ones");
+    bench_step.dependOn(&run_pthread_bench.step);
+
     const libc = b.addLibrary(.{
         .linkage = .dynamic,
         .name = "c",
@@ -1,56 +1,167 @@
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "config.h"
 
-#define LIB_OVERRIDE_MAP_DEFAULT_SIZE 8
-struct lib_override *lib_override_map = NULL;
-size_t lib_override_map_len = 0;
-static size_t lib_override_map_size = 0;
+/* The override maps from all the cfg.d directories are compiled into a
+ * single image: a header, the cfg.d directories it was built from (with
+ * their mtimes), an open addressing hash table, the directive lines and the
+ * strings. The image is written to $XDG_CACHE_HOME/bionic_translation/ so
+ * that subsequent processes only have to stat() the cfg.d directories and
+ * mmap() it; it's rebuilt whenever any of the directories' mtime changes
+ * (note that this means editing a cfg file in place without touching the
+ * directory won't be noticed).
+ */
 
-static void lib_override_map_append(char *from, char *to)
+#define CFG_CACHE_MAGIC "BTCFGC\0\0"
+#define CFG_CACHE_VERSION 2
+
+struct cfg_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint32_t ndirs;
+	uint32_t nentries;
+	uint32_t nslots; /* power of two */
+	uint32_t dirs_off;
+	uint32_t slots_off; /* uint32_t each, entry index + 1, 0 for empty */
+	uint32_t entries_off;
+	uint32_t ndirectives;
+	uint32_t directives_off; /* uint32_t string offset each */
+	uint32_t strings_off;
+};
+
+struct cfg_cache_dir {
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t path_off;
+	uint32_t exists;
+};
+
+struct cfg_cache_entry {
+	uint32_t hash;
+	uint32_t from_off;
+	uint32_t to_off;
+};
+
+static const struct cfg_cache_header *cfg_cache = NULL;
+static size_t cfg_cache_size = 0;
+static bool cfg_cache_mapped = false;
+
+static uint32_t cfg_hash(const char *s)
+{
+	uint32_t h = 5381;
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+static const char *cfg_cache_str(const struct cfg_cache_header *hdr, uint32_t off)
 {
-	if(!lib_override_map) {
-		lib_override_map_size = LIB_OVERRIDE_MAP_DEFAULT_SIZE;
-		lib_override_map = malloc(lib_override_map_size * sizeof(struct lib_override));
+	return (const char *)hdr + hdr->strings_off + off;
+}
+
+/* --- parsing the cfg.d directories */
+
+struct cfg_builder {
+	struct cfg_cache_entry *entries;
+	size_t nentries;
+	size_t entries_size;
+	uint32_t *directives;
+	size_t ndirectives;
+	size_t directives_size;
+	char *strings;
+	size_t strings_len;
+	size_t strings_size;
+};
+
+static uint32_t cfg_builder_add_string(struct cfg_builder *b, const char *s, size_t len)
+{
+	if (b->strings_len + len + 1 > b->strings_size) {
+		b->strings_size = b->strings_size ? b->strings_size * 2 : 4096;
+		while (b->strings_len + len + 1 > b->strings_size)
+			b->strings_size *= 2;
+		b->strings = realloc(b->strings, b->strings_size);
 	}
 
-	if(lib_override_map_len == lib_override_map_size) {
-		lib_override_map_size *= 2;
-		lib_override_map = realloc(lib_override_map, lib_override_map_size * sizeof(struct lib_override));
+	uint32_t off = b->strings_len;
+	memcpy(b->strings + off, s, len);
+	b->strings[off + len] = '\0';
+	b->strings_len += len + 1;
+	return off;
+}
+
+static void cfg_builder_add_override(struct cfg_builder *b, const char *from, size_t from_len, const char *to, size_t to_len)
+{
+	if (b->nentries == b->entries_size) {
+		b->entries_size = b->entries_size ? b->entries_size * 2 : 8;
+		b->entries = realloc(b->entries, b->entries_size * sizeof(*b->entries));
+	}
+
+	struct cfg_cache_entry *e = &b->entries[b->nentries++];
+	e->from_off = cfg_builder_add_string(b, from, from_len);
+	e->to_off = cfg_builder_add_string(b, to, to_len);
+	e->hash = cfg_hash(b->strings + e->from_off);
+}
+
+/* lines starting with '@' aren't overrides but directives for other parts
+ * of the linker, e.g. `@populate libmain.so`; they're kept as is (minus
+ * the '@' and any comment) to be looked up with cfg_directive() */
+static void cfg_builder_add_directive(struct cfg_builder *b, const char *line)
+{
+	size_t len = strcspn(line, "#\r\n");
+	while (len && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+		len--;
+
+	if (b->ndirectives == b->directives_size) {
+		b->directives_size = b->directives_size ? b->directives_size * 2 : 8;
+		b->directives = realloc(b->directives, b->directives_size * sizeof(*b->directives));
 	}
 
-	lib_override_map[lib_override_map_len].from = from;
-	lib_override_map[lib_override_map_len].to = to;
-	lib_override_map_len += 1;
+	b->directives[b->ndirectives++] = cfg_builder_add_string(b, line, len);
 }
 
-static void process_cfg_line(char *line, size_t len, char *path, int linenum)
+static void process_cfg_line(struct cfg_builder *b, const char *line, const char *path, int linenum)
 {
-	char *from;
-	char *to;
-	int ret;
+	const char *ws = " \t\r\n\v\f";
+	const char *from, *to;
+	size_t from_len, to_len;
 
 	// skip empty lines and comments
 	if(line[0] == '#' || line[0] == '\n')
 		return;
 
-	ret = sscanf(line, "%ms %ms", &from, &to);
-	if(ret != 2) {
+	if(line[0] == '@') {
+		cfg_builder_add_directive(b, line + 1);
+		return;
+	}
+
+	from = line + strspn(line, ws);
+	from_len = strcspn(from, ws);
+	to = from + from_len + strspn(from + from_len, ws);
+	to_len = strcspn(to, ws);
+	if(!from_len || !to_len) {
 		printf("error reading cfg: %s:%d\n", path, linenum);
 		exit(1);
 	}
 
-	lib_override_map_append(from, to);
+	cfg_builder_add_override(b, from, from_len, to, to_len);
 }
 
-static void read_cfg_file(char *path)
+static void read_cfg_file(struct cfg_builder *b, const char *path)
 {
 	char *line = NULL;
-	size_t line_len;
+	size_t line_len = 0;
 	int linenum = 1;
 
 	FILE *cfg = fopen(path, "r");
@@ -59,30 +170,333 @@ static void read_cfg_file(char *path)
 		exit(1);
 	}
 
-	while(getline(&line, &line_len, cfg) > 0) {
-		process_cfg_line(line, line_len, path, linenum++);
-		free(line);
-		line = NULL;
-	}
+	while(getline(&line, &line_len, cfg) > 0)
+		process_cfg_line(b, line, path, linenum++);
 
+	free(line);
 	fclose(cfg);
 }
 
-void read_cfg_dir(char *cfg_dir_path)
+static int cfg_dirent_cmp(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int cfg_dirent_filter(const struct dirent *entry)
+{
+	return strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..");
+}
+
+static void read_cfg_dir(struct cfg_builder *b, const char *cfg_dir_path)
+{
+	struct dirent **entries;
+	int n = scandir(cfg_dir_path, &entries, cfg_dirent_filter, cfg_dirent_cmp);
+	if(n < 0)
+		return;
+
+	for(int i = 0; i < n; i++) {
+		char *full_path = malloc(strlen(cfg_dir_path) + 1 + strlen(entries[i]->d_name) + 1); // +1 for /, +1 for NUL
+		sprintf(full_path, "%s/%s", cfg_dir_path, entries[i]->d_name);
+		read_cfg_file(b, full_path);
+		free(full_path);
+		free(entries[i]);
+	}
+	free(entries);
+}
+
+/* --- the compiled image */
+
+static struct cfg_cache_header *cfg_cache_build(const char *const *cfg_dirs, const struct stat *dir_stats, size_t ndirs)
+{
+	struct cfg_builder b = {0};
+	uint32_t *dir_path_offs = malloc((ndirs ?: 1) * sizeof(uint32_t));
+
+	for (size_t i = 0; i < ndirs; i++) {
+		dir_path_offs[i] = cfg_builder_add_string(&b, cfg_dirs[i], strlen(cfg_dirs[i]));
+		read_cfg_dir(&b, cfg_dirs[i]);
+	}
+
+	uint32_t nslots = 8;
+	while (nslots < b.nentries * 2)
+		nslots <<= 1;
+
+	size_t dirs_off = sizeof(struct cfg_cache_header);
+	size_t slots_off = dirs_off + ndirs * sizeof(struct cfg_cache_dir);
+	size_t entries_off = slots_off + nslots * sizeof(uint32_t);
+	size_t directives_off = entries_off + b.nentries * sizeof(struct cfg_cache_entry);
+	size_t strings_off = directives_off + b.ndirectives * sizeof(uint32_t);
+	size_t size = strings_off + b.strings_len;
+
+	struct cfg_cache_header *hdr = calloc(1, size);
+	memcpy(hdr->magic, CFG_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CFG_CACHE_VERSION;
+	hdr->size = size;
+	hdr->ndirs = ndirs;
+	hdr->nentries = b.nentries;
+	hdr->nslots = nslots;
+	hdr->dirs_off = dirs_off;
+	hdr->slots_off = slots_off;
+	hdr->entries_off = entries_off;
+	hdr->ndirectives = b.ndirectives;
+	hdr->directives_off = directives_off;
+	hdr->strings_off = strings_off;
+
+	struct cfg_cache_dir *dirs = (struct cfg_cache_dir *)((char *)hdr + dirs_off);
+	for (size_t i = 0; i < ndirs; i++) {
+		dirs[i].path_off = dir_path_offs[i];
+		dirs[i].exists = dir_stats[i].st_ino != 0;
+		dirs[i].mtime_sec = dir_stats[i].st_mtim.tv_sec;
+		dirs[i].mtime_nsec = dir_stats[i].st_mtim.tv_nsec;
+	}
+
+	uint32_t *slots = (uint32_t *)((char *)hdr + slots_off);
+	memcpy((char *)hdr + entries_off, b.entries, b.nentries * sizeof(struct cfg_cache_entry));
+	memcpy((char *)hdr + directives_off, b.directives, b.ndirectives * sizeof(uint32_t));
+	memcpy((char *)hdr + strings_off, b.strings, b.strings_len);
+
+	for (uint32_t i = 0; i < b.nentries; i++) {
+		uint32_t slot = b.entries[i].hash & (nslots - 1);
+		bool dup = false;
+
+		/* the first mapping for a name wins */
+		for (; slots[slot]; slot = (slot + 1) & (nslots - 1)) {
+			const struct cfg_cache_entry *e = &b.entries[slots[slot] - 1];
+			if (e->hash == b.entries[i].hash && !strcmp(b.strings + e->from_off, b.strings + b.entries[i].from_off)) {
+				dup = true;
+				break;
+			}
+		}
+		if (!dup)
+			slots[slot] = i + 1;
+	}
+
+	free(dir_path_offs);
+	free(b.entries);
+	free(b.directives);
+	free(b.strings);
+	return hdr;
+}
+
+static bool cfg_cache_valid(const struct cfg_cache_header *hdr, size_t size, const char *const *cfg_dirs, const struct stat *dir_stats, size_t ndirs)
+{
+	if (size < sizeof(*hdr) || memcmp(hdr->magic, CFG_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CFG_CACHE_VERSION || hdr->size != size || hdr->ndirs != ndirs ||
+	    hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) ||
+	    hdr->dirs_off + (size_t)ndirs * sizeof(struct cfg_cache_dir) > size ||
+	    hdr->slots_off + (size_t)hdr->nslots * sizeof(uint32_t) > size ||
+	    hdr->entries_off + (size_t)hdr->nentries * sizeof(struct cfg_cache_entry) > size ||
+	    hdr->directives_off + (size_t)hdr->ndirectives * sizeof(uint32_t) > size ||
+	    hdr->strings_off >= size || ((const char *)hdr)[size - 1] != '\0')
+		return false;
+
+	size_t strings_len = size - hdr->strings_off;
+	const struct cfg_cache_entry *entries = (const struct cfg_cache_entry *)((const char *)hdr + hdr->entries_off);
+	for (size_t i = 0; i < hdr->nentries; i++) {
+		if (entries[i].from_off >= strings_len || entries[i].to_off >= strings_len)
+			return false;
+	}
+
+	const uint32_t *directives = (const uint32_t *)((const char *)hdr + hdr->directives_off);
+	for (size_t i = 0; i < hdr->ndirectives; i++) {
+		if (directives[i] >= strings_len)
+			return false;
+	}
+
+	const uint32_t *slots = (const uint32_t *)((const char *)hdr + hdr->slots_off);
+	for (size_t i = 0; i < hdr->nslots; i++) {
+		if (slots[i] > hdr->nentries)
+			return false;
+	}
+
+	const struct cfg_cache_dir *dirs = (const struct cfg_cache_dir *)((const char *)hdr + hdr->dirs_off);
+	for (size_t i = 0; i < ndirs; i++) {
+		if (dirs[i].path_off >= strings_len ||
+		    strcmp(cfg_cache_str(hdr, dirs[i].path_off), cfg_dirs[i]) ||
+		    dirs[i].exists != (dir_stats[i].st_ino != 0) ||
+		    dirs[i].mtime_sec != dir_stats[i].st_mtim.tv_sec ||
+		    dirs[i].mtime_nsec != dir_stats[i].st_mtim.tv_nsec)
+			return false;
+	}
+
+	return true;
+}
+
+char *cfg_cache_dir(bool create_dir)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char *dir;
+
+	if (cache_home && cache_home[0] == '/') {
+		if (asprintf(&dir, "%s/bionic_translation", cache_home) < 0)
+			return NULL;
+		if (create_dir)
+			mkdir(cache_home, 0700);
+	} else if (home && home[0] == '/') {
+		if (asprintf(&dir, "%s/.cache/bionic_translation", home) < 0)
+			return NULL;
+		if (create_dir) {
+			char *cache = strndup(dir, strlen(dir) - sizeof("/bionic_translation") + 1);
+			mkdir(cache, 0700);
+			free(cache);
+		}
+	} else {
+		return NULL;
+	}
+
+	if (create_dir)
+		mkdir(dir, 0700);
+
+	return dir;
+}
+
+/* $XDG_CACHE_HOME/bionic_translation/cfg-<hash of the cfg.d list>.cache, the
+ * hash keeps processes with a different XDG_DATA_DIRS from fighting over it */
+static char *cfg_cache_path(const char *const *cfg_dirs, size_t ndirs, bool create_dir)
+{
+	char *dir = cfg_cache_dir(create_dir);
+	uint32_t h = 5381;
+
+	if (!dir)
+		return NULL;
+
+	for (size_t i = 0; i < ndirs; i++)
+		h = h * 33 + cfg_hash(cfg_dirs[i]);
+
+	char *path;
+	if (asprintf(&path, "%s/cfg-%08x.cache", dir, h) < 0)
+		path = NULL;
+	free(dir);
+	return path;
+}
+
+static bool cfg_cache_map(const char *path, const char *const *cfg_dirs, const struct stat *dir_stats, size_t ndirs)
+{
+	struct stat st;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct cfg_cache_header)) {
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	if (!cfg_cache_valid(map, st.st_size, cfg_dirs, dir_stats, ndirs)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	cfg_cache = map;
+	cfg_cache_size = st.st_size;
+	cfg_cache_mapped = true;
+	return true;
+}
+
+static void cfg_cache_write(const char *path, const struct cfg_cache_header *hdr)
 {
-	struct dirent *entry;
+	char *tmp_path;
+	if (asprintf(&tmp_path, "%s.%d.tmp", path, getpid()) < 0)
+		return;
 
-	DIR *cfg_dir = opendir(cfg_dir_path);
-	if(!cfg_dir)
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		free(tmp_path);
 		return;
+	}
 
-	while(entry = readdir(cfg_dir)) {
-		if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+	size_t written = 0;
+	while (written < hdr->size) {
+		ssize_t ret = write(fd, (const char *)hdr + written, hdr->size - written);
+		if (ret < 0 && errno == EINTR)
 			continue;
+		if (ret <= 0)
+			break;
+		written += ret;
+	}
+	close(fd);
+
+	if (written != hdr->size || rename(tmp_path, path) < 0)
+		unlink(tmp_path);
+	free(tmp_path);
+}
+
+void read_cfg_dirs(const char *const *cfg_dirs, size_t ndirs)
+{
+	struct stat *dir_stats = calloc(ndirs ?: 1, sizeof(struct stat));
+
+	if (cfg_cache) {
+		if (cfg_cache_mapped)
+			munmap((void *)cfg_cache, cfg_cache_size);
+		else
+			free((void *)cfg_cache);
+		cfg_cache = NULL;
+	}
+
+	/* a missing directory is recorded as st_ino == 0 */
+	for (size_t i = 0; i < ndirs; i++) {
+		if (stat(cfg_dirs[i], &dir_stats[i]) < 0)
+			memset(&dir_stats[i], 0, sizeof(dir_stats[i]));
+	}
+
+	char *path = cfg_cache_path(cfg_dirs, ndirs, false);
+	if (!path || !cfg_cache_map(path, cfg_dirs, dir_stats, ndirs)) {
+		struct cfg_cache_header *hdr = cfg_cache_build(cfg_dirs, dir_stats, ndirs);
+
+		free(path);
+		path = cfg_cache_path(cfg_dirs, ndirs, true);
+		if (path)
+			cfg_cache_write(path, hdr);
+
+		cfg_cache = hdr;
+		cfg_cache_size = hdr->size;
+		cfg_cache_mapped = false;
+	}
+
+	free(path);
+	free(dir_stats);
+}
+
+const char *lib_override_lookup(const char *name)
+{
+	const struct cfg_cache_header *hdr = cfg_cache;
+	if (!hdr || !hdr->nentries)
+		return NULL;
+
+	const uint32_t *slots = (const uint32_t *)((const char *)hdr + hdr->slots_off);
+	const struct cfg_cache_entry *entries = (const struct cfg_cache_entry *)((const char *)hdr + hdr->entries_off);
+	uint32_t hash = cfg_hash(name);
+
+	for (uint32_t slot = hash & (hdr->nslots - 1); slots[slot]; slot = (slot + 1) & (hdr->nslots - 1)) {
+		uint32_t i = slots[slot] - 1;
+		if (entries[i].hash == hash && !strcmp(cfg_cache_str(hdr, entries[i].from_off), name))
+			return cfg_cache_str(hdr, entries[i].to_off);
+	}
+
+	return NULL;
+}
+
+const char *cfg_directive(const char *keyword, size_t *iter)
+{
+	const struct cfg_cache_header *hdr = cfg_cache;
+	size_t keyword_len = strlen(keyword);
+
+	if (!hdr)
+		return NULL;
 
-		char *full_path = malloc(strlen(cfg_dir_path) + 1 + strlen(entry->d_name) + 1); // +1 for /, +1 for NUL
-		sprintf(full_path, "%s/%s", cfg_dir_path, entry->d_name);
-		read_cfg_file(full_path);
+	const uint32_t *directives = (const uint32_t *)((const char *)hdr + hdr->directives_off);
+	while (*iter < hdr->ndirectives) {
+		const char *directive = cfg_cache_str(hdr, directives[(*iter)++]);
+		if (!strncmp(directive, keyword, keyword_len) &&
+		    (directive[keyword_len] == ' ' || directive[keyword_len] == '\t' || directive[keyword_len] == '\0'))
+			return directive + keyword_len + strspn(directive + keyword_len, " \t");
 	}
 
+	return NULL;
 }
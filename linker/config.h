@@ -1,12 +1,20 @@
 #ifndef CONFIG_H
 #define CONFIG_H
-struct lib_override {
-	char *from;
-	char *to;
-};
+#include <stdbool.h>
+#include <stddef.h>
 
-extern struct lib_override *lib_override_map;
-extern size_t lib_override_map_len;
+/* loads the library overrides (lines like `libc.so libc_bio.so.0`) from the
+ * given cfg.d directories, earlier directories take precedence */
+void read_cfg_dirs(const char *const *cfg_dirs, size_t ndirs);
 
-void read_cfg_dir(char *cfg_dir_path);
+/* returns what `name` should be replaced with, or NULL */
+const char *lib_override_lookup(const char *name);
+
+/* returns the arguments of the next `@<keyword> ...` line after *iter (which
+ * should start out as 0), or NULL if there are no more */
+const char *cfg_directive(const char *keyword, size_t *iter);
+
+/* $XDG_CACHE_HOME/bionic_translation (or ~/.cache/...), malloc()ed; NULL if
+ * neither variable is usable */
+char *cfg_cache_dir(bool create_dir);
 #endif
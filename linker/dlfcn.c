@@ -55,6 +55,22 @@ static const char *dl_errors[] = {
 #define unlikely(expr) __builtin_expect(expr, 0)
 
 static pthread_mutex_t apkenv_dl_lock = PTHREAD_MUTEX_INITIALIZER;
+/* whether this thread holds apkenv_dl_lock, so dl_try_addr() can tell a
+ * constructor of ours (which may well create threads) from another thread
+ * loading libraries */
+static __thread bool apkenv_dl_lock_held;
+
+static void dl_lock(void)
+{
+	pthread_mutex_lock(&apkenv_dl_lock);
+	apkenv_dl_lock_held = true;
+}
+
+static void dl_unlock(void)
+{
+	apkenv_dl_lock_held = false;
+	pthread_mutex_unlock(&apkenv_dl_lock);
+}
 
 static void set_dlerror(int err)
 {
@@ -67,22 +83,33 @@ void *bionic_dlopen(const char *filename, int flag)
 {
 //	verbose("%s (%d)", filename, flag);
 	soinfo *ret;
-	pthread_mutex_lock(&apkenv_dl_lock);
+	dl_lock();
 	void *glibc_handle = NULL;
 	ret = apkenv_find_library(filename, true, flag, &glibc_handle); // flag only used for glibc dlopen
 
 	if (ret) {
 		apkenv_call_constructors_recursive(ret);
 		ret->refcount++;
+		apkenv_trim_hash_tables(ret);
 	} else if (glibc_handle) {
 		ret = glibc_handle;
 	} else {
 		set_dlerror(DL_ERR_CANNOT_LOAD_LIBRARY);
 	}
-	pthread_mutex_unlock(&apkenv_dl_lock);
+	dl_unlock();
 	return ret;
 }
 
+void dl_get_loader_stats(struct dl_loader_stats *stats, size_t size)
+{
+	struct dl_loader_stats tmp;
+
+	dl_lock();
+	apkenv_get_loader_stats(&tmp);
+	dl_unlock();
+	memcpy(stats, &tmp, size < sizeof(tmp) ? size : sizeof(tmp));
+}
+
 const char *bionic_dlerror(void)
 {
 	const char *tmp = dl_err_str;
@@ -104,7 +131,7 @@ void *bionic_dlsym(void *handle, const char *symbol)
 	ElfW(Sym) *sym;
 	unsigned bind;
 
-	pthread_mutex_lock(&apkenv_dl_lock);
+	dl_lock();
 
 	if (unlikely(symbol == 0)) {
 		set_dlerror(DL_ERR_BAD_SYMBOL_NAME);
@@ -118,22 +145,22 @@ void *bionic_dlsym(void *handle, const char *symbol)
 
 	if (!is_this_our_handle) { // if the handle is not our handle, we can probably just try calling glibc dlsym
 		if ((sym = dlsym(RTLD_DEFAULT, wrap_sym_name))) { // TODO: this is not ideal, we should probably translate all android system libary names to ..._android.so.0 and have those either be symlinks or small libs which depend on the actual lib and in addition implement bionic_ overrides
-			pthread_mutex_unlock(&apkenv_dl_lock);
+			dl_unlock();
 			verbose("system dlopen handle: found bionic_ version");
 			return wrapper_create(symbol, sym);
 		} else if ((sym = dlsym(handle, symbol))) {
-			pthread_mutex_unlock(&apkenv_dl_lock);
+			dl_unlock();
 			verbose("system dlopen handle: found system version");
 			return wrapper_create(symbol, sym);
 		}
 	}
 
 	if ((sym = dlsym(RTLD_DEFAULT, wrap_sym_name))) {
-		pthread_mutex_unlock(&apkenv_dl_lock);
+		dl_unlock();
 		verbose("RTLD_DEFAULT: found bionic_ version");
 		return wrapper_create(symbol, sym);
 	} else if ((sym = dlsym(RTLD_DEFAULT, symbol))) {
-		pthread_mutex_unlock(&apkenv_dl_lock);
+		dl_unlock();
 		verbose("RTLD_DEFAULT: found system version");
 		return wrapper_create(symbol, sym);
 	} else {
@@ -157,6 +184,7 @@ void *bionic_dlsym(void *handle, const char *symbol)
 		}
 	} else if (is_this_our_handle) {
 		found = (soinfo *)handle;
+		found->flags |= FLAG_DLSYM;
 		sym = apkenv_lookup_in_library(found, symbol);
 	} else {
 		sym = 0;
@@ -167,7 +195,7 @@ void *bionic_dlsym(void *handle, const char *symbol)
 
 		if (likely((bind == STB_GLOBAL) && (sym->st_shndx != 0))) {
 			intptr_t ret = sym->st_value + found->base;
-			pthread_mutex_unlock(&apkenv_dl_lock);
+			dl_unlock();
 			return wrapper_create((char *)symbol, (void *)ret);
 		}
 
@@ -177,16 +205,14 @@ void *bionic_dlsym(void *handle, const char *symbol)
 
 err:
 	verbose("symbol %s has not been hooked\n", symbol);
-	pthread_mutex_unlock(&apkenv_dl_lock);
+	dl_unlock();
 	return 0;
 }
 
-int bionic_dladdr(const void *addr, Dl_info *info)
+static int dladdr_locked(const void *addr, Dl_info *info)
 {
 	int ret = 0;
 
-	pthread_mutex_lock(&apkenv_dl_lock);
-
 	/* Determine if this address can be found in any library currently mapped */
 	soinfo *si = apkenv_find_containing_library(addr);
 
@@ -207,8 +233,26 @@ int bionic_dladdr(const void *addr, Dl_info *info)
 		ret = 1;
 	}
 
-	pthread_mutex_unlock(&apkenv_dl_lock);
+	return ret;
+}
 
+int bionic_dladdr(const void *addr, Dl_info *info)
+{
+	dl_lock();
+	int ret = dladdr_locked(addr, info);
+	dl_unlock();
+	return ret;
+}
+
+int dl_try_addr(const void *addr, Dl_info *info)
+{
+	// the libraries are all linked by the time their constructors run
+	if (apkenv_dl_lock_held)
+		return dladdr_locked(addr, info);
+	if (pthread_mutex_trylock(&apkenv_dl_lock))
+		return -1;
+	int ret = dladdr_locked(addr, info);
+	pthread_mutex_unlock(&apkenv_dl_lock);
 	return ret;
 }
 
@@ -219,9 +263,9 @@ int bionic_dlclose(void *handle)
 		return 0;
 #endif
 
-	pthread_mutex_lock(&apkenv_dl_lock);
+	dl_lock();
 	(void)apkenv_unload_library((soinfo *)handle);
-	pthread_mutex_unlock(&apkenv_dl_lock);
+	dl_unlock();
 	return 0;
 }
 
@@ -336,17 +380,22 @@ __attribute__((constructor)) void construct(void)
 
 	// the config files contain overrides like libc.so -> libc_bio.so.0
 	const char *xdg_data_dirs = getenv("XDG_DATA_DIRS") ?: "/usr/local/share:/usr/share";
-	char *cfg_path = malloc(strlen(xdg_data_dirs) + sizeof("/bionic_translation/cfg.d"));
+	size_t cfg_dirs_count = 0;
+	const char **cfg_dirs = malloc((strlen(xdg_data_dirs) / 2 + 2) * sizeof(char *)); // at most every other char is a ':'
 	while (*xdg_data_dirs) {
 		size_t len = strcspn(xdg_data_dirs, ":");
+		char *cfg_path = malloc(len + sizeof("/bionic_translation/cfg.d"));
 		memcpy(cfg_path, xdg_data_dirs, len);
 		memcpy(cfg_path + len, "/bionic_translation/cfg.d", sizeof("/bionic_translation/cfg.d"));
-		read_cfg_dir(cfg_path);
+		cfg_dirs[cfg_dirs_count++] = cfg_path;
 		xdg_data_dirs += len;
 		xdg_data_dirs += strspn(xdg_data_dirs, ":");
 	}
-	free(cfg_path);
-	read_cfg_dir("/etc/bionic_translation/cfg.d");
+	cfg_dirs[cfg_dirs_count++] = "/etc/bionic_translation/cfg.d";
+	read_cfg_dirs(cfg_dirs, cfg_dirs_count);
+	for (size_t i = 0; i < cfg_dirs_count - 1; i++)
+		free((char *)cfg_dirs[i]);
+	free(cfg_dirs);
 
 
 	// since it seems to not be particularly trivial to figure out which
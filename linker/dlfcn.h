@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 #define RTLD_LAZY	  0x00001 /* Lazy function call binding.  */
 #define RTLD_NOW	  0x00002 /* Immediate function call binding.  */
 #define RTLD_BINDING_MASK 0x3	  /* Mask of binding time value.  */
@@ -10,11 +12,51 @@
 extern "C" {
 #endif
 
+/* counters describing what the linker did to speed up loading, see
+ * dl_get_loader_stats() */
+struct dl_loader_stats {
+	/* pages of text prefaulted with MAP_POPULATE (each one a page fault
+	 * that won't be taken at runtime) */
+	unsigned long long prefaulted_pages;
+	/* pages for which readahead was started (MADV_WILLNEED) */
+	unsigned long long readahead_pages;
+	/* bytes of segments advised with MADV_HUGEPAGE */
+	unsigned long long hugepage_advised_bytes;
+	/* pages for which readahead was started from a recorded page profile
+	 * (BIONIC_LD_PGPROF_RECORD) */
+	unsigned long long profile_replayed_pages;
+	/* bytes of text (BIONIC_LD_THP_TEXT) backed by huge pages after
+	 * loading, as reported by /proc/self/smaps */
+	unsigned long long thp_text_bytes;
+	/* bytes of text copied to anonymous memory for lack of file THP */
+	unsigned long long thp_text_copied_bytes;
+	/* bytes of link-time only metadata (relocation tables, hash tables of
+	 * libraries not used with dlsym) dropped after linking (BIONIC_LD_TRIM) */
+	unsigned long long trimmed_bytes;
+	/* bytes of such metadata only marked cold, since the library has text
+	 * relocations and the pages may have been written to */
+	unsigned long long trimmed_cold_bytes;
+	/* bytes of relocated writable segments advised MADV_MERGEABLE
+	 * (BIONIC_LD_MERGE) */
+	unsigned long long merge_advised_bytes;
+	/* DT_NEEDED libraries deferred (BIONIC_LD_LAZY) and never needed by a
+	 * relocation, and the ones that were loaded late after all */
+	unsigned long long deferred_needed_skipped;
+	unsigned long long deferred_needed_loaded;
+};
+
 void dl_parse_library_path(const char *path, char *delim);
 void *bionic_dlopen(const char *filename, int flag);
 const char *bionic_dlerror(void);
 void *bionic_dlsym(void *handle, const char *symbol);
 int bionic_dlclose(void *handle);
+/* bionic_dladdr() for callers that mustn't wait for the linker, which holds
+ * its lock while running constructors (that may be waiting for them): -1
+ * without looking the address up if another thread has it */
+int dl_try_addr(const void *addr, Dl_info *info);
+/* fills in up to `size` bytes of `stats`, so that callers built against an
+ * older version of struct dl_loader_stats keep working */
+void dl_get_loader_stats(struct dl_loader_stats *stats, size_t size);
 
 #ifdef __cplusplus
 }
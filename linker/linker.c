@@ -49,10 +49,13 @@
 
 #include <pthread.h>
 
+#include <sys/auxv.h>
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/prctl.h>
 
 #include <libgen.h>
+#include <dirent.h>
 
 /* eglGetProcAddress to import funny extensions that Android exports but Mesa sometimes doesn't */
 #include <EGL/egl.h>
@@ -72,6 +75,7 @@
 #include "linker_debug.h"
 #include "linker_environ.h"
 #include "linker_format.h"
+#include "dlfcn.h"
 
 #define ALLOW_SYMBOLS_FROM_MAIN 1
 #define SO_MAX 128
@@ -126,6 +130,22 @@ static soinfo *apkenv_sonext = &apkenv_libdl_info;
 static soinfo *apkenv_somain; /* main process, always the one after apkenv_libdl_info */
 #endif
 
+/* Hot lookup descriptors, apkenv_solookup[i] belongs to apkenv_sopool[i] and
+ * the extra last one to apkenv_libdl_info. They're filled in on first use
+ * (kind == SOINFO_LOOKUP_UNSET) and reset whenever the soinfo is reused. */
+static struct soinfo_lookup apkenv_solookup[SO_MAX + 1];
+_Static_assert(sizeof(struct soinfo_lookup) == 64, "struct soinfo_lookup should be one cache line");
+
+static inline struct soinfo_lookup *apkenv_soinfo_lookup(soinfo *si)
+{
+	return si == &apkenv_libdl_info ? &apkenv_solookup[SO_MAX] : &apkenv_solookup[si - apkenv_sopool];
+}
+
+static inline soinfo *apkenv_lookup_soinfo(struct soinfo_lookup *l)
+{
+	return l == &apkenv_solookup[SO_MAX] ? &apkenv_libdl_info : &apkenv_sopool[l - apkenv_solookup];
+}
+
 bool do_we_have_this_handle(void *handle)
 {
 	soinfo *si;
@@ -137,11 +157,11 @@ bool do_we_have_this_handle(void *handle)
 	return false;
 }
 
-static inline int apkenv_validate_soinfo(soinfo *si)
-{
-	return (si >= apkenv_sopool && si < apkenv_sopool + SO_MAX) ||
-	       si == &apkenv_libdl_info;
-}
+/* Bumped whenever a library is added to / removed from apkenv_solist, and
+ * reported through dl_iterate_phdr's dlpi_adds / dlpi_subs so that unwinders
+ * (libgcc, libunwind) can keep their FDE caches across calls. */
+static unsigned long long apkenv_dl_adds = 0;
+static unsigned long long apkenv_dl_subs = 0;
 
 static char apkenv_ldpaths_buf[LDPATH_BUFSIZE];
 static const char *apkenv_ldpaths[LDPATH_MAX + 1];
@@ -245,6 +265,8 @@ static void apkenv_remove_soinfo_from_debug_map(soinfo *info)
 
 	if (apkenv_r_debug_tail == map)
 		apkenv_r_debug_tail = map->l_prev;
+	if (apkenv_r_debug_head == map)
+		apkenv_r_debug_head = map->l_next;
 
 	if (map->l_prev)
 		map->l_prev->l_next = map->l_next;
@@ -299,6 +321,8 @@ static void apkenv_notify_gdb_of_unload(soinfo *info)
 void apkenv_notify_gdb_of_libraries(void)
 {
 	struct link_map *tmap = _r_debug_ptr->r_map;
+	if (!apkenv_r_debug_head)
+		return;
 	while (tmap->l_next != NULL)
 		tmap = tmap->l_next;
 
@@ -312,8 +336,10 @@ void apkenv_notify_gdb_of_libraries(void)
 	_r_debug_ptr->r_state = RT_CONSISTENT;
 	rtld_db_dlactivity();
 
-	/* restore so that ld-linux doesn't freak out */
+	/* restore so that ld-linux doesn't freak out (and so that unloading
+	 * our first library doesn't link it into ld-linux's list) */
 	tmap->l_next = NULL;
+	apkenv_r_debug_head->l_prev = NULL;
 }
 
 static soinfo *apkenv_alloc_info(const char *name)
@@ -342,6 +368,7 @@ static soinfo *apkenv_alloc_info(const char *name)
 
 	/* Make sure we get a clean block of soinfo */
 	memset(si, 0, sizeof(soinfo));
+	memset(apkenv_soinfo_lookup(si), 0, sizeof(struct soinfo_lookup));
 	apkenv_strlcpy((char *)si->name, name, sizeof(si->name));
 	apkenv_sonext->next = si;
 	si->next = NULL;
@@ -373,10 +400,14 @@ static void apkenv_free_info(soinfo *si)
 	   always the static apkenv_libdl_info.
 	*/
 	prev->next = si->next;
+	free(si->sysv_index);
+	si->sysv_index = NULL;
+	memset(apkenv_soinfo_lookup(si), 0, sizeof(struct soinfo_lookup));
 	if (si == apkenv_sonext)
 		apkenv_sonext = prev;
 	si->next = apkenv_freelist;
 	apkenv_freelist = si;
+	apkenv_dl_subs++;
 }
 
 /* For a given PC, find the .so that it belongs to.
@@ -404,7 +435,12 @@ _Unwind_Ptr bionic_dl_unwind_find_exidx(_Unwind_Ptr pc, int *pcount)
 }
 #elif defined(__aarch64__) || defined(__i386__) || defined(__mips__) || defined(__x86_64__)
 /* Here, we only have to provide a callback to iterate across all the
- * loaded libraries. gcc_eh does the rest. */
+ * loaded libraries. gcc_eh does the rest.
+ *
+ * We pass the full sizeof(struct dl_phdr_info), so every field has to be
+ * valid: the unwinders only trust their FDE cache if dlpi_adds / dlpi_subs
+ * are there and unchanged since the last call. We don't set up PT_TLS
+ * for bionic libraries, so there is never a TLS module to report. */
 int bionic_dl_iterate_phdr(int (*cb)(struct dl_phdr_info *info, size_t size, void *data),
 			   void *data)
 {
@@ -412,10 +448,18 @@ int bionic_dl_iterate_phdr(int (*cb)(struct dl_phdr_info *info, size_t size, voi
 	struct dl_phdr_info dl_info;
 	int rv = 0;
 	for (si = apkenv_solist; si != NULL; si = si->next) {
-		dl_info.dlpi_addr = si->linkmap.l_addr;
-		dl_info.dlpi_name = si->linkmap.l_name;
-		dl_info.dlpi_phdr = (void *)si->phdr;
-		dl_info.dlpi_phnum = si->phnum;
+		if (si->flags & FLAG_ERROR)
+			continue;
+		dl_info = (struct dl_phdr_info){
+			.dlpi_addr = si->linkmap.l_addr,
+			.dlpi_name = si->linkmap.l_name,
+			.dlpi_phdr = (void *)si->phdr,
+			.dlpi_phnum = si->phnum,
+			.dlpi_adds = apkenv_dl_adds,
+			.dlpi_subs = apkenv_dl_subs,
+			.dlpi_tls_modid = 0,
+			.dlpi_tls_data = NULL,
+		};
 		if ((rv = cb(&dl_info, sizeof(struct dl_phdr_info), data)) != 0)
 			break;
 	}
@@ -423,6 +467,123 @@ int bionic_dl_iterate_phdr(int (*cb)(struct dl_phdr_info *info, size_t size, voi
 }
 #endif
 
+#if !defined(__arm__)
+/* The host unwinder (libgcc_s) doesn't know about our libraries, since it
+ * only finds FDEs through the host's dl_iterate_phdr. Register each
+ * library's .eh_frame with it directly, so that host code unwinding through
+ * bionic frames (C++ exceptions, backtraces) gets a sorted, indexed lookup.
+ * We resolve these at runtime, since nothing guarantees libgcc_s is loaded.
+ */
+#define DW_EH_PE_omit	 0xff
+#define DW_EH_PE_absptr	 0x00
+#define DW_EH_PE_udata4	 0x03
+#define DW_EH_PE_udata8	 0x04
+#define DW_EH_PE_sdata4	 0x0b
+#define DW_EH_PE_sdata8	 0x0c
+#define DW_EH_PE_pcrel	 0x10
+#define DW_EH_PE_datarel 0x30
+#define DW_EH_PE_indirect 0x80
+
+static void (*apkenv_register_frame_info)(const void *begin, void *ob);
+static void *(*apkenv_deregister_frame_info)(const void *begin);
+
+/* decode the eh_frame_ptr field of a .eh_frame_hdr section */
+static const void *apkenv_eh_frame_from_hdr(const unsigned char *hdr)
+{
+	const unsigned char *p = hdr + 4;
+	unsigned char enc = hdr[1];
+	uintptr_t val;
+
+	if (hdr[0] != 1 || enc == DW_EH_PE_omit)
+		return NULL;
+
+	switch (enc & 0x0f) {
+	case DW_EH_PE_absptr: {
+		uintptr_t v;
+		memcpy(&v, p, sizeof(v));
+		val = v;
+		break;
+	}
+	case DW_EH_PE_udata4: {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		val = v;
+		break;
+	}
+	case DW_EH_PE_sdata4: {
+		int32_t v;
+		memcpy(&v, p, sizeof(v));
+		val = (intptr_t)v;
+		break;
+	}
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8: {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		val = (uintptr_t)v;
+		break;
+	}
+	default:
+		return NULL;
+	}
+
+	switch (enc & 0x70) {
+	case DW_EH_PE_absptr:
+		break;
+	case DW_EH_PE_pcrel:
+		val += (uintptr_t)p;
+		break;
+	case DW_EH_PE_datarel:
+		val += (uintptr_t)hdr;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (enc & DW_EH_PE_indirect)
+		val = *(uintptr_t *)val;
+
+	return (const void *)val;
+}
+
+static void apkenv_register_eh_frame(soinfo *si)
+{
+	ElfW(Phdr) *phdr = si->phdr;
+	const void *eh_frame = NULL;
+
+	for (size_t i = 0; i < si->phnum; i++, phdr++) {
+		if (phdr->p_type == PT_GNU_EH_FRAME) {
+			eh_frame = apkenv_eh_frame_from_hdr((const unsigned char *)(si->base + phdr->p_vaddr));
+			break;
+		}
+	}
+	if (!eh_frame)
+		return;
+
+	if (!apkenv_register_frame_info) {
+		apkenv_register_frame_info = dlsym(RTLD_DEFAULT, "__register_frame_info");
+		apkenv_deregister_frame_info = dlsym(RTLD_DEFAULT, "__deregister_frame_info");
+		if (!apkenv_register_frame_info || !apkenv_deregister_frame_info) {
+			apkenv_register_frame_info = NULL;
+			return;
+		}
+	}
+
+	TRACE("[ %5d registering .eh_frame of '%s' @ %p ]\n", apkenv_pid, si->name, eh_frame);
+	apkenv_register_frame_info(eh_frame, si->eh_frame_object);
+	si->eh_frame = eh_frame;
+}
+
+static void apkenv_deregister_eh_frame(soinfo *si)
+{
+	if (!si->eh_frame)
+		return;
+
+	apkenv_deregister_frame_info(si->eh_frame);
+	si->eh_frame = NULL;
+}
+#endif
+
 static inline bool is_gnu_hash(soinfo *si)
 {
 	return (si->flags & FLAG_GNU_HASH);
@@ -442,6 +603,7 @@ static uint32_t apkenv_sysvhash(struct symbol_name *symbol_name)
 		}
 
 		symbol_name->sysv_hash = h;
+		symbol_name->has_sysv_hash = true;
 	}
 
 	return symbol_name->sysv_hash;
@@ -457,35 +619,207 @@ static uint32_t apkenv_gnuhash(struct symbol_name *symbol_name)
 		}
 
 		symbol_name->gnu_hash = h;
+		symbol_name->has_gnu_hash = true;
 	}
 
 	return symbol_name->gnu_hash;
 }
 
+/* only concern ourselves with global and weak symbol definitions */
+static bool is_symbol_exported(const ElfW(Sym) *s) {
+	return (ELF_ST_BIND(s->st_info) == STB_GLOBAL ||
+	        ELF_ST_BIND(s->st_info) == STB_WEAK) &&
+	       s->st_shndx != SHN_UNDEF;
+}
+
 static bool is_symbol_global_and_defined(const soinfo *si, const ElfW(Sym) *s) {
-	/* only concern ourselves with global and weak symbol definitions */
-	if (ELF_ST_BIND(s->st_info) == STB_GLOBAL ||
-	    ELF_ST_BIND(s->st_info) == STB_WEAK) {
-		return s->st_shndx != SHN_UNDEF;
-	} else if (ELF_ST_BIND(s->st_info) != STB_LOCAL) {
+	if (ELF_ST_BIND(s->st_info) != STB_GLOBAL &&
+	    ELF_ST_BIND(s->st_info) != STB_WEAK &&
+	    ELF_ST_BIND(s->st_info) != STB_LOCAL) {
 		WARN("unexpected ST_BIND value: %d for '%s' in '%s'",
 		     ELF_ST_BIND(s->st_info), si->strtab + s->st_name, si->name);
 	}
 
-	return false;
+	return is_symbol_exported(s);
+}
+
+/* DT_HASH has no bloom filter and no stored hashes, so every miss walks a
+ * whole chain with a strcmp per entry. For libraries that only ship DT_HASH
+ * we build the equivalent of a DT_GNU_HASH section on the side: a bloom
+ * filter and buckets of {full gnu hash, symbol index} pairs covering only
+ * the symbols a lookup can actually return. Small libraries aren't worth
+ * the memory, BIONIC_LD_SYSV_INDEX=<n> sets the minimum symbol count
+ * (0 indexes everything, a negative value disables the index). */
+#define APKENV_SYSV_INDEX_MIN_DEFAULT 64
+#define APKENV_SYSV_INDEX_SHIFT2 26
+
+struct apkenv_sysv_index {
+	uint32_t bucket_mask;
+	uint32_t bloom_mask;
+	ElfW(Addr) *bloom;
+	/* entries of bucket b are entries[bucket[b]] .. entries[bucket[b + 1] - 1] */
+	uint32_t *bucket;
+	struct apkenv_sysv_index_entry *entries;
+};
+
+static long apkenv_sysv_index_min = -2; /* -2: BIONIC_LD_SYSV_INDEX not read yet */
+
+static uint32_t apkenv_pow2_ceil(uint32_t n)
+{
+	uint32_t p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+static struct apkenv_sysv_index *apkenv_build_sysv_index(soinfo *si)
+{
+	const uint32_t bloom_bits = sizeof(ElfW(Addr)) * 8;
+	uint32_t count = 0;
+
+	/* hash each exported symbol once, in symbol table order */
+	struct apkenv_sysv_index_entry *symbols = malloc(si->nchain * sizeof(*symbols));
+	if (!symbols)
+		return NULL;
+
+	for (size_t i = 1; i < si->nchain; i++) {
+		const ElfW(Sym) *s = si->symtab + i;
+		if (!is_symbol_exported(s))
+			continue;
+
+		struct symbol_name symbol_name = { .name = si->strtab + s->st_name };
+		symbols[count++] = (struct apkenv_sysv_index_entry){ apkenv_gnuhash(&symbol_name), i };
+	}
+
+	/* ~1 entry per bucket, ~8 bloom bits per symbol */
+	uint32_t nbucket = apkenv_pow2_ceil(count ? count : 1);
+	uint32_t maskwords = apkenv_pow2_ceil((count * 8 + bloom_bits - 1) / bloom_bits ?: 1);
+
+	struct apkenv_sysv_index *idx = calloc(1, sizeof(*idx) +
+	                                       maskwords * sizeof(ElfW(Addr)) +
+	                                       count * sizeof(struct apkenv_sysv_index_entry) +
+	                                       (nbucket + 1) * sizeof(uint32_t));
+	uint32_t *fill = calloc(nbucket, sizeof(uint32_t));
+	if (!idx || !fill) {
+		free(fill);
+		free(idx);
+		free(symbols);
+		return NULL;
+	}
+
+	idx->bucket_mask = nbucket - 1;
+	idx->bloom_mask = maskwords - 1;
+	idx->bloom = (ElfW(Addr) *)(idx + 1);
+	idx->entries = (struct apkenv_sysv_index_entry *)(idx->bloom + maskwords);
+	idx->bucket = (uint32_t *)(idx->entries + count);
+
+	/* counting sort by bucket: count, prefix sum, scatter (stable, so a
+	 * bucket keeps symbol table order) */
+	for (uint32_t n = 0; n < count; n++) {
+		uint32_t hash = symbols[n].hash;
+		idx->bloom[(hash / bloom_bits) & idx->bloom_mask] |=
+		    ((ElfW(Addr))1 << (hash % bloom_bits)) |
+		    ((ElfW(Addr))1 << ((hash >> APKENV_SYSV_INDEX_SHIFT2) % bloom_bits));
+		idx->bucket[(hash & idx->bucket_mask) + 1]++;
+	}
+
+	for (uint32_t b = 0; b < nbucket; b++)
+		idx->bucket[b + 1] += idx->bucket[b];
+
+	for (uint32_t n = 0; n < count; n++) {
+		uint32_t b = symbols[n].hash & idx->bucket_mask;
+		idx->entries[idx->bucket[b] + fill[b]++] = symbols[n];
+	}
+	free(fill);
+	free(symbols);
+
+	TRACE("[ %5d built sysv index for '%s': %u symbols, %u buckets, %u bloom words ]\n",
+	      apkenv_pid, si->name, count, nbucket, maskwords);
+	return idx;
+}
+
+static void apkenv_fill_soinfo_lookup(struct soinfo_lookup *l)
+{
+	soinfo *si = apkenv_lookup_soinfo(l);
+
+	l->strtab = si->strtab;
+	l->symtab = si->symtab;
+	l->base = si->base;
+
+	if (is_gnu_hash(si)) {
+		l->kind = SOINFO_LOOKUP_GNU;
+		l->bucket = si->bucket;
+		l->chain = si->chain;
+		l->bloom_filter = si->gnu_bloom_filter;
+		l->nbucket = si->nbucket;
+		l->maskwords = si->gnu_maskwords;
+		l->shift2 = si->gnu_shift2;
+		return;
+	}
+
+	if (apkenv_sysv_index_min == -2) {
+		const char *env = getenv("BIONIC_LD_SYSV_INDEX");
+		apkenv_sysv_index_min = env ? strtol(env, NULL, 0) : APKENV_SYSV_INDEX_MIN_DEFAULT;
+		if (apkenv_sysv_index_min < 0)
+			apkenv_sysv_index_min = -1;
+	}
+
+	if (!si->sysv_index && apkenv_sysv_index_min >= 0 && si->nchain >= (size_t)apkenv_sysv_index_min)
+		si->sysv_index = apkenv_build_sysv_index(si);
+
+	if (si->sysv_index) {
+		l->kind = SOINFO_LOOKUP_SYSV_INDEX;
+		l->bucket = si->sysv_index->bucket;
+		l->entries = si->sysv_index->entries;
+		l->bloom_filter = si->sysv_index->bloom;
+		l->nbucket = si->sysv_index->bucket_mask;
+		l->maskwords = si->sysv_index->bloom_mask;
+		l->shift2 = APKENV_SYSV_INDEX_SHIFT2;
+	} else {
+		l->kind = SOINFO_LOOKUP_SYSV;
+		l->bucket = si->bucket;
+		l->chain = si->chain;
+		l->nbucket = si->nbucket;
+	}
+}
+
+static ElfW(Sym) * apkenv__elf_lookup_sysv_index(struct soinfo_lookup *l, struct symbol_name *symbol_name)
+{
+	const uint32_t bloom_bits = sizeof(ElfW(Addr)) * 8;
+	uint32_t hash = apkenv_gnuhash(symbol_name);
+	ElfW(Addr) bloom_word = l->bloom_filter[(hash / bloom_bits) & l->maskwords];
+
+	if ((1 & (bloom_word >> (hash % bloom_bits)) & (bloom_word >> ((hash >> l->shift2) % bloom_bits))) == 0)
+		return NULL;
+
+	uint32_t b = hash & l->nbucket;
+	for (uint32_t n = l->bucket[b]; n < l->bucket[b + 1]; n++) {
+		if (l->entries[n].hash != hash)
+			continue;
+
+		ElfW(Sym) *s = l->symtab + l->entries[n].symidx;
+		if (!strcmp(l->strtab + s->st_name, symbol_name->name)) {
+			TRACE_TYPE(LOOKUP, "FOUND %s in %s (%p) %zd",
+			           symbol_name->name, apkenv_lookup_soinfo(l)->name, (void *)(s->st_value), (size_t)(s->st_size));
+			return s;
+		}
+	}
+
+	return NULL;
 }
 
-static ElfW(Sym) * apkenv__elf_lookup_sysv(soinfo *si, struct symbol_name *symbol_name)
+static ElfW(Sym) * apkenv__elf_lookup_sysv(struct soinfo_lookup *l, struct symbol_name *symbol_name)
 {
+	soinfo *si = apkenv_lookup_soinfo(l);
 	const char *name = symbol_name->name;
 	uint32_t hash = apkenv_sysvhash(symbol_name);
 
 	TRACE_TYPE(LOOKUP, "SEARCH %s in %s@%p h=%x(elf) %zd",
-	           name, si->name, (void *)si->base, hash, hash % si->nbucket);
+	           name, si->name, (void *)l->base, hash, (size_t)(hash % l->nbucket));
 
-	for (uint32_t n = si->bucket[hash % si->nbucket]; n != 0; n = si->chain[n]) {
-		ElfW(Sym) *s = si->symtab + n;
-		if (!strcmp(si->strtab + s->st_name, name) && is_symbol_global_and_defined(si, s)) {
+	for (uint32_t n = l->bucket[hash % l->nbucket]; n != 0; n = l->chain[n]) {
+		ElfW(Sym) *s = l->symtab + n;
+		if (!strcmp(l->strtab + s->st_name, name) && is_symbol_global_and_defined(si, s)) {
 			TRACE_TYPE(LOOKUP, "FOUND %s in %s (%p) %zd",
 			           name, si->name, (void *)(s->st_value), (size_t)(s->st_size));
 			return s;
@@ -493,52 +827,62 @@ static ElfW(Sym) * apkenv__elf_lookup_sysv(soinfo *si, struct symbol_name *symbo
 	}
 
 	TRACE_TYPE(LOOKUP, "NOT FOUND %s in %s@%p h=%x(elf) %zd",
-	           symbol_name->name, si->name, (void *)si->base, hash, hash % si->nbucket);
+	           symbol_name->name, si->name, (void *)l->base, hash, (size_t)(hash % l->nbucket));
 
 	return NULL;
 }
 
-static ElfW(Sym) * apkenv__elf_lookup_gnu(soinfo *si, struct symbol_name *symbol_name)
+static ElfW(Sym) * apkenv__elf_lookup_gnu(struct soinfo_lookup *l, struct symbol_name *symbol_name)
 {
 	const char *name = symbol_name->name;
 	uint32_t hash = apkenv_gnuhash(symbol_name);
-	uint32_t h2 = hash >> si->gnu_shift2;
+	uint32_t h2 = hash >> l->shift2;
 	uint32_t bloom_mask_bits = sizeof(ElfW(Addr))*8;
-	uint32_t word_num = (hash / bloom_mask_bits) & si->gnu_maskwords;
-	ElfW(Addr) bloom_word = si->gnu_bloom_filter[word_num];
+	uint32_t word_num = (hash / bloom_mask_bits) & l->maskwords;
+	ElfW(Addr) bloom_word = l->bloom_filter[word_num];
 
 	TRACE_TYPE(LOOKUP, "SEARCH %s in %s@%p h=%x(gnu) %zd",
-	           name, si->name, (void *)si->base, hash, hash % si->nbucket);
+	           name, apkenv_lookup_soinfo(l)->name, (void *)l->base, hash, (size_t)(hash % l->nbucket));
 
 	// test against bloom filter
 	if ((1 & (bloom_word >> (hash % bloom_mask_bits)) & (bloom_word >> (h2 % bloom_mask_bits))) == 0)
 		return NULL;
 
 	// bloom test says "probably yes"...
-	uint32_t n = si->bucket[hash % si->nbucket];
+	uint32_t n = l->bucket[hash % l->nbucket];
 	if (n == 0)
 		return NULL;
 
 	do {
-		ElfW(Sym)* s = si->symtab + n;
-		if (((si->chain[n] ^ hash) >> 1) == 0 &&
-		    strcmp(si->strtab + s->st_name, name) == 0 &&
-		    is_symbol_global_and_defined(si, s)) {
+		ElfW(Sym)* s = l->symtab + n;
+		if (((l->chain[n] ^ hash) >> 1) == 0 &&
+		    strcmp(l->strtab + s->st_name, name) == 0 &&
+		    is_symbol_global_and_defined(apkenv_lookup_soinfo(l), s)) {
 			TRACE_TYPE(LOOKUP, "FOUND %s in %s (%p) %zd",
-			           name, si->name, (void *)(s->st_value), (size_t)(s->st_size));
+			           name, apkenv_lookup_soinfo(l)->name, (void *)(s->st_value), (size_t)(s->st_size));
 			return s;
 		}
-	} while ((si->chain[n++] & 1) == 0);
+	} while ((l->chain[n++] & 1) == 0);
 
 	TRACE_TYPE(LOOKUP, "NOT FOUND %s in %s@%p h=%x(gnu) %zd",
-	           symbol_name->name, si->name, (void *)si->base, hash, hash % si->nbucket);
+	           symbol_name->name, apkenv_lookup_soinfo(l)->name, (void *)l->base, hash, (size_t)(hash % l->nbucket));
 
 	return NULL;
 }
 
-static ElfW(Sym) * apkenv__elf_lookup(soinfo *si, struct symbol_name *symbol_name)
+static ElfW(Sym) * apkenv__elf_lookup(struct soinfo_lookup *l, struct symbol_name *symbol_name)
 {
-	return is_gnu_hash(si) ? apkenv__elf_lookup_gnu(si, symbol_name) : apkenv__elf_lookup_sysv(si, symbol_name);
+	switch (l->kind) {
+		case SOINFO_LOOKUP_UNSET:
+			apkenv_fill_soinfo_lookup(l);
+			return apkenv__elf_lookup(l, symbol_name);
+		case SOINFO_LOOKUP_GNU:
+			return apkenv__elf_lookup_gnu(l, symbol_name);
+		case SOINFO_LOOKUP_SYSV_INDEX:
+			return apkenv__elf_lookup_sysv_index(l, symbol_name);
+		default:
+			return apkenv__elf_lookup_sysv(l, symbol_name);
+	}
 }
 
 const char *apkenv_last_library_used = NULL;
@@ -547,13 +891,11 @@ static ElfW(Sym) *
     apkenv__do_lookup(soinfo *si, const char *name, ElfW(Addr) * base)
 {
 	struct symbol_name symbol_name = { .name = name };
-	ElfW(Sym) * s;
-	soinfo *lsi = si;
-	int i;
+	ElfW(Sym) *s = NULL;
+	struct soinfo_lookup *l = NULL;
 
-	/* Look for symbols in the local scope (the object who is
-	 * searching). This happens with C++ templates on i386 for some
-	 * reason.
+	/* The scope was put together by apkenv_build_lookup_scope() when
+	 * linking, see there for the search order.
 	 *
 	 * Notes on weak symbols:
 	 * The ELF specs are ambigious about treatment of weak definitions in
@@ -561,55 +903,22 @@ static ElfW(Sym) *
 	 * and some the first non-weak definition.   This is system dependent.
 	 * Here we return the first definition found for simplicity.  */
 
-	s = apkenv__elf_lookup(si, &symbol_name);
-	if (s != NULL)
-		goto done;
-
-	/* Next, look for it in the apkenv_preloads list */
-	for (i = 0; apkenv_preloads[i] != NULL; i++) {
-		lsi = apkenv_preloads[i];
-		s = apkenv__elf_lookup(lsi, &symbol_name);
+	for (size_t i = 0; i < si->lookup_scope_count; i++) {
+		l = si->lookup_scope[i];
+		DEBUG("%5d %s: looking up %s in %s\n",
+		      apkenv_pid, si->name, name, apkenv_lookup_soinfo(l)->name);
+		s = apkenv__elf_lookup(l, &symbol_name);
 		if (s != NULL)
-			goto done;
-	}
-
-	for (ElfW(Dyn) *d = si->dynamic; d->d_tag != DT_NULL; d++) {
-		if (d->d_tag == DT_NEEDED) {
-			lsi = (soinfo *)d->d_un.d_val;
-			if (!apkenv_validate_soinfo(lsi)) {
-				DL_ERR("%5d bad DT_NEEDED pointer in %s",
-				       apkenv_pid, si->name);
-				return NULL;
-			}
-
-			DEBUG("%5d %s: looking up %s in %s\n",
-			      apkenv_pid, si->name, name, lsi->name);
-			s = apkenv__elf_lookup(lsi, &symbol_name);
-			if ((s != NULL) && (s->st_shndx != SHN_UNDEF))
-				goto done;
-		}
-	}
-
-#if ALLOW_SYMBOLS_FROM_MAIN
-	/* If we are resolving relocations while dlopen()ing a library, it's OK for
-	 * the library to resolve a symbol that's defined in the executable itself,
-	 * although this is rare and is generally a bad idea.
-	 */
-	if (apkenv_somain) {
-		lsi = apkenv_somain;
-		DEBUG("%5d %s: looking up %s in executable %s\n",
-		      apkenv_pid, si->name, name, lsi->name);
-		s = apkenv__elf_lookup(lsi, &symbol_name);
+			break;
 	}
-#endif
 
-done:
 	if (s != NULL) {
+		soinfo *lsi = apkenv_lookup_soinfo(l);
 		TRACE_TYPE(LOOKUP, "%5d si %s sym %s s->st_value = 0x%016lx, "
 				   "found in %s, base = 0x%016lx\n",
 			   apkenv_pid, si->name, name, s->st_value, lsi->name, lsi->base);
 		apkenv_last_library_used = lsi->name;
-		*base = lsi->base;
+		*base = l->base;
 		return s;
 	}
 
@@ -621,7 +930,7 @@ done:
  */
 ElfW(Sym) * apkenv_lookup_in_library(soinfo *si, const char *name)
 {
-	return apkenv__elf_lookup(si, &(struct symbol_name){ .name = name });
+	return apkenv__elf_lookup(apkenv_soinfo_lookup(si), &(struct symbol_name){ .name = name });
 }
 
 /* This is used by dl_sym().  It performs a global symbol lookup.
@@ -639,7 +948,7 @@ ElfW(Sym) * apkenv_lookup(const char *name, soinfo **found, soinfo *start)
 	for (si = start; (s == NULL) && (si != NULL); si = si->next) {
 		if (si->flags & FLAG_ERROR)
 			continue;
-		s = apkenv__elf_lookup(si, &symbol_name);
+		s = apkenv__elf_lookup(apkenv_soinfo_lookup(si), &symbol_name);
 		if (s != NULL) {
 			*found = si;
 			break;
@@ -745,12 +1054,287 @@ static const char *apkenv_sopaths[SOPATH_MAX + 1] = {
 #endif
 };
 
+/* Rather than stat()ing every candidate path, each search directory is
+ * opened once (O_PATH) and listed once into a hash set of the names it
+ * contains. A name that isn't in the set is known to be missing for as long
+ * as the directory's mtime stays the same, which a miss checks with a single
+ * fstat(). Finding a library is then a hash lookup plus one openat(). */
+struct apkenv_search_dir {
+	char *path;       /* as given, used to build fullpath */
+	char *normalized; /* realpath() of path, path itself if that fails */
+	bool is_pattern;  /* contains fnmatch() wildcards, never listed */
+	bool scanned;
+	int fd;           /* O_PATH, -1 if the directory couldn't be opened */
+	struct timespec mtime;
+	uint32_t mask;    /* number of slots - 1 */
+	const char **slots;
+	char *names;      /* the entry names, back to back */
+	/* <path>/glibc-hwcaps/<name>/ for each of apkenv_hwcaps that exists,
+	 * best first, these are searched before the directory itself */
+	struct apkenv_search_dir *hwcaps;
+	size_t hwcaps_count;
+};
+
+static struct apkenv_search_dir apkenv_ldpath_dirs[LDPATH_MAX];
+static struct apkenv_search_dir apkenv_sopath_dirs[SOPATH_MAX];
+
+static uint32_t apkenv_name_hash(const char *name)
+{
+	uint32_t h = 5381;
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h;
+}
+
+/* Subdirectories of a search directory holding builds of the same libraries
+ * for newer CPUs, in the layout glibc uses: <dir>/glibc-hwcaps/<name>/. The
+ * names are picked once, best match first. glibc only defines names for
+ * x86-64 (and power/s390), for aarch64 we use the -march names of the
+ * feature levels that matter for the libraries we've seen. */
+#define HWCAPS_MAX 4
+static const char *apkenv_hwcaps[HWCAPS_MAX + 1];
+static bool apkenv_hwcaps_initialized = false;
+
+static void apkenv_hwcaps_init(void)
+{
+	int n = 0;
+
+	apkenv_hwcaps_initialized = true;
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("x86-64-v4"))
+		apkenv_hwcaps[n++] = "x86-64-v4";
+	if (__builtin_cpu_supports("x86-64-v3"))
+		apkenv_hwcaps[n++] = "x86-64-v3";
+	if (__builtin_cpu_supports("x86-64-v2"))
+		apkenv_hwcaps[n++] = "x86-64-v2";
+#elif defined(__aarch64__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	unsigned long hwcap2 = getauxval(AT_HWCAP2);
+	/* HWCAP2_SVE2 | HWCAP2_I8MM, HWCAP_ASIMDDP | HWCAP_ATOMICS */
+	if ((hwcap2 & ((1 << 1) | (1 << 13))) == ((1 << 1) | (1 << 13)))
+		apkenv_hwcaps[n++] = "armv9-a";
+	if ((hwcap & ((1 << 20) | (1 << 8))) == ((1 << 20) | (1 << 8)))
+		apkenv_hwcaps[n++] = "armv8.2-a+dotprod";
+#endif
+	apkenv_hwcaps[n] = NULL;
+
+	for (int i = 0; i < n; i++)
+		TRACE("[ %5d hwcaps: %s ]\n", apkenv_pid, apkenv_hwcaps[i]);
+}
+
+static void apkenv_search_dir_init(struct apkenv_search_dir *d, const char *path);
+
+static void apkenv_search_dir_clear(struct apkenv_search_dir *d)
+{
+	for (size_t i = 0; i < d->hwcaps_count; i++)
+		apkenv_search_dir_clear(&d->hwcaps[i]);
+	free(d->hwcaps);
+
+	if (d->path && d->fd >= 0)
+		close(d->fd);
+	free(d->path);
+	free(d->normalized);
+	free(d->slots);
+	free(d->names);
+	memset(d, 0, sizeof(*d));
+	d->fd = -1;
+}
+
+static void apkenv_search_dir_init(struct apkenv_search_dir *d, const char *path)
+{
+	apkenv_search_dir_clear(d);
+
+	d->path = strdup(path);
+	d->normalized = realpath(path, NULL);
+	if (!d->normalized)
+		d->normalized = strdup(path);
+	d->is_pattern = strpbrk(path, "*?[") != NULL;
+	if (!d->is_pattern)
+		d->fd = open(d->normalized, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+	TRACE("[ %5d search path '%s' -> '%s' (fd %d) ]\n", apkenv_pid, d->path, d->normalized, d->fd);
+
+	if (d->fd < 0 || faccessat(d->fd, "glibc-hwcaps", F_OK, 0) < 0)
+		return;
+
+	if (!apkenv_hwcaps_initialized)
+		apkenv_hwcaps_init();
+
+	for (int i = 0; apkenv_hwcaps[i]; i++) {
+		char buf[512];
+		int n = format_buffer(buf, sizeof(buf), "%s/glibc-hwcaps/%s", path, apkenv_hwcaps[i]);
+		if (n < 0 || n >= (int)sizeof(buf) || faccessat(d->fd, buf + strlen(path) + 1, F_OK, 0) < 0)
+			continue;
+
+		if (!d->hwcaps && !(d->hwcaps = calloc(HWCAPS_MAX, sizeof(*d->hwcaps))))
+			return;
+		apkenv_search_dir_init(&d->hwcaps[d->hwcaps_count++], buf);
+	}
+}
+
+static void apkenv_search_dir_scan(struct apkenv_search_dir *d)
+{
+	struct stat st;
+	size_t names_len = 0, names_size = 0, count = 0;
+	char *names = NULL;
+
+	free(d->slots);
+	free(d->names);
+	d->slots = NULL;
+	d->names = NULL;
+	d->mask = 0;
+	d->scanned = true;
+
+	if (fstat(d->fd, &st) < 0)
+		return;
+	d->mtime = st.st_mtim;
+
+	int fd = openat(d->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (ent->d_type != DT_REG && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN)
+			continue;
+
+		size_t len = strlen(ent->d_name) + 1;
+		if (names_len + len > names_size) {
+			names_size = MAX(names_size * 2, names_len + len + 4096);
+			char *tmp = realloc(names, names_size);
+			if (!tmp)
+				break;
+			names = tmp;
+		}
+		memcpy(names + names_len, ent->d_name, len);
+		names_len += len;
+		count++;
+	}
+	closedir(dir);
+
+	uint32_t slots = 8;
+	while (slots < count * 2)
+		slots <<= 1;
+
+	d->slots = calloc(slots, sizeof(*d->slots));
+	if (!d->slots) {
+		free(names);
+		return;
+	}
+	d->names = names;
+	d->mask = slots - 1;
+
+	for (size_t off = 0; off < names_len; off += strlen(names + off) + 1) {
+		uint32_t i = apkenv_name_hash(names + off) & d->mask;
+		while (d->slots[i])
+			i = (i + 1) & d->mask;
+		d->slots[i] = names + off;
+	}
+
+	TRACE("[ %5d indexed %zu entries in '%s' ]\n", apkenv_pid, count, d->path);
+}
+
+static bool apkenv_search_dir_has(struct apkenv_search_dir *d, const char *name)
+{
+	if (!d->slots)
+		return false;
+
+	for (uint32_t i = apkenv_name_hash(name) & d->mask; d->slots[i]; i = (i + 1) & d->mask) {
+		if (!strcmp(d->slots[i], name))
+			return true;
+	}
+
+	return false;
+}
+
+static int apkenv_search_dir_openat(struct apkenv_search_dir *d, const char *name)
+{
+	struct stat st;
+
+	int fd = openat(d->fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Opens `name` (a plain file name) if it's in `d` */
+static int apkenv_search_dir_open(struct apkenv_search_dir *d, const char *name)
+{
+	struct stat st;
+
+	if (d->fd < 0)
+		return -1;
+
+	if (!d->scanned)
+		apkenv_search_dir_scan(d);
+
+	if (!apkenv_search_dir_has(d, name)) {
+		/* refresh the listing if the directory changed since */
+		if (fstat(d->fd, &st) < 0 ||
+		    (st.st_mtim.tv_sec == d->mtime.tv_sec && st.st_mtim.tv_nsec == d->mtime.tv_nsec))
+			return -1;
+
+		apkenv_search_dir_scan(d);
+		if (!apkenv_search_dir_has(d, name))
+			return -1;
+	}
+
+	return apkenv_search_dir_openat(d, name);
+}
+
+static int apkenv_search_dirs_open(struct apkenv_search_dir *dirs, size_t count, const char *name, char *fullpath)
+{
+	bool has_slash = strchr(name, '/') != NULL;
+
+	for (size_t i = 0; i < count && dirs[i].path; i++) {
+		int fd;
+
+		if (has_slash) {
+			/* `name` has directories in it, not worth indexing, but
+			 * we can still avoid resolving the search path again */
+			if (name[0] == '/' || dirs[i].fd < 0)
+				continue;
+			fd = apkenv_search_dir_openat(&dirs[i], name);
+		} else {
+			if (dirs[i].hwcaps_count &&
+			    (fd = apkenv_search_dirs_open(dirs[i].hwcaps, dirs[i].hwcaps_count, name, fullpath)) >= 0)
+				return fd;
+			fd = apkenv_search_dir_open(&dirs[i], name);
+		}
+
+		if (fd >= 0) {
+			int n = format_buffer(fullpath, 512, "%s/%s", dirs[i].path, name);
+			if (n < 0 || n >= 512) {
+				WARN("Ignoring very long library path: %s/%s\n", dirs[i].path, name);
+				close(fd);
+				continue;
+			}
+			return fd;
+		}
+	}
+
+	return -1;
+}
+
 int apkenv_add_sopath(const char *path)
 {
 	int i;
 	for (i = 0; i < SOPATH_MAX; i++) {
 		if (apkenv_sopaths[i] == NULL) {
 			apkenv_sopaths[i] = path;
+			apkenv_search_dir_init(&apkenv_sopath_dirs[i], path);
 			return 0;
 		}
 
@@ -770,22 +1354,17 @@ static int apkenv__open_lib(const char *name)
 	TRACE("[ %5d apkenv__open_lib called with %s ]\n", apkenv_pid, name);
 
 	if ((stat(name, &filestat) >= 0) && S_ISREG(filestat.st_mode)) {
-		if ((fd = open(name, O_RDONLY)) >= 0)
+		if ((fd = open(name, O_RDONLY | O_CLOEXEC)) >= 0)
 			return fd;
 	}
 
 	return -1;
 }
 
+/* `fullpath` must have room for 512 bytes */
 static int apkenv_open_library(const char *name, char *fullpath)
 {
 	int fd;
-	char buf[512];
-	const char **path;
-	int n;
-
-	char *path_normalized_name;
-	char *tmp_name;
 
 	TRACE("[ %5d opening %s ]\n", apkenv_pid, name);
 
@@ -796,56 +1375,39 @@ static int apkenv_open_library(const char *name, char *fullpath)
 
 	strcpy(fullpath, name);
 
-	tmp_name = strdup(name);
-	path_normalized_name = realpath(dirname(tmp_name), NULL);
-	free(tmp_name);
-
-	for (path = apkenv_ldpaths; *path; path++) {
-		char *ldpath_normalized = realpath(*path, NULL);
-		if (!ldpath_normalized)
-			ldpath_normalized = strdup(*path);
-		if (path_normalized_name && ldpath_normalized) {
-			TRACE("[ %5d comparing '%s' against '%s' to see if the libary is in BIONIC_LD_LIBRARY_PATH ]\n", apkenv_pid, path_normalized_name, ldpath_normalized);
-			if (!fnmatch(ldpath_normalized, path_normalized_name, 0)) {
-				if ((fd = apkenv__open_lib(name)) >= 0) {
-					free(ldpath_normalized);
-					free(path_normalized_name);
-					return fd;
+	/* a path to a library is only opened as is if it points into
+	 * BIONIC_LD_LIBRARY_PATH */
+	if (strchr(name, '/')) {
+		char *tmp_name = strdup(name);
+		char *path_normalized_name = tmp_name ? realpath(dirname(tmp_name), NULL) : NULL;
+		free(tmp_name);
+
+		if (path_normalized_name) {
+			for (size_t i = 0; i < LDPATH_MAX && apkenv_ldpath_dirs[i].path; i++) {
+				TRACE("[ %5d comparing '%s' against '%s' to see if the libary is in BIONIC_LD_LIBRARY_PATH ]\n", apkenv_pid, path_normalized_name, apkenv_ldpath_dirs[i].normalized);
+				if (!fnmatch(apkenv_ldpath_dirs[i].normalized, path_normalized_name, 0)) {
+					if ((fd = apkenv__open_lib(name)) >= 0) {
+						free(path_normalized_name);
+						return fd;
+					}
 				}
 			}
-			free(ldpath_normalized);
+			free(path_normalized_name);
 		} else {
-			WARN("realpath returned NULL: can't compare path_normalized_name('%s') vs ldpath_normalized('%s')\n", path_normalized_name, ldpath_normalized);
-		}
-
-		n = format_buffer(buf, sizeof(buf), "%s/%s", *path, name);
-		if (n < 0 || n >= (int)sizeof(buf)) {
-			WARN("Ignoring very long library path: %s/%s\n", *path, name);
-			continue;
-		}
-		if ((fd = apkenv__open_lib(buf)) >= 0) {
-			strcpy(fullpath, buf);
-			if (path_normalized_name)
-				free(path_normalized_name);
-			return fd;
+			WARN("realpath returned NULL: can't check whether '%s' is in BIONIC_LD_LIBRARY_PATH\n", name);
 		}
 	}
 
-	free(path_normalized_name);
+	if ((fd = apkenv_search_dirs_open(apkenv_ldpath_dirs, LDPATH_MAX, name, fullpath)) >= 0)
+		return fd;
 
-	for (path = apkenv_sopaths; *path; path++) {
-		n = format_buffer(buf, sizeof(buf), "%s/%s", *path, name);
-		if (n < 0 || n >= (int)sizeof(buf)) {
-			WARN("Ignoring very long library path: %s/%s\n", *path, name);
-			continue;
-		}
-		if ((fd = apkenv__open_lib(buf)) >= 0) {
-			strcpy(fullpath, buf);
-			return fd;
-		}
+	/* the default paths are only set up on first use */
+	for (size_t i = 0; i < SOPATH_MAX && apkenv_sopaths[i]; i++) {
+		if (!apkenv_sopath_dirs[i].path)
+			apkenv_search_dir_init(&apkenv_sopath_dirs[i], apkenv_sopaths[i]);
 	}
 
-	return -1;
+	return apkenv_search_dirs_open(apkenv_sopath_dirs, SOPATH_MAX, name, fullpath);
 }
 
 typedef struct {
@@ -936,129 +1498,1026 @@ apkenv_verify_elf_object(void *base, const char *name)
 static intptr_t
 apkenv_get_lib_extents(int fd, const char *name, void *__hdr, size_t *total_sz)
 {
-	intptr_t req_base;
-	intptr_t min_vaddr = 0xffffffff;
-	intptr_t max_vaddr = 0;
-	unsigned char *_hdr = (unsigned char *)__hdr;
-	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)_hdr;
-	ElfW(Phdr) * phdr;
-	int cnt;
+	intptr_t req_base;
+	intptr_t min_vaddr = 0xffffffff;
+	intptr_t max_vaddr = 0;
+	unsigned char *_hdr = (unsigned char *)__hdr;
+	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)_hdr;
+	ElfW(Phdr) * phdr;
+	int cnt;
+
+	TRACE("[ %5d Computing extents for '%s'. ]\n", apkenv_pid, name);
+	if (apkenv_verify_elf_object(_hdr, name) < 0) {
+		DL_ERR("%5d - %s is not a valid ELF object", apkenv_pid, name);
+		return (intptr_t)-1;
+	}
+
+	req_base = (intptr_t)apkenv_is_prelinked(fd, name);
+	if (req_base == (intptr_t)-1)
+		return -1;
+	else if (req_base != 0) {
+		TRACE("[ %5d - Prelinked library '%s' requesting base @ 0x%016lx ]\n",
+		      apkenv_pid, name, req_base);
+	} else {
+		TRACE("[ %5d - Non-prelinked library '%s' found. ]\n", apkenv_pid, name);
+	}
+
+	phdr = (ElfW(Phdr) *)(_hdr + ehdr->e_phoff);
+
+	/* find the min/max p_vaddrs from all the PT_LOAD segments so we can
+	 * get the range. */
+	for (cnt = 0; cnt < ehdr->e_phnum; ++cnt, ++phdr) {
+		if (phdr->p_type == PT_LOAD) {
+			if ((phdr->p_vaddr + phdr->p_memsz) > max_vaddr)
+				max_vaddr = phdr->p_vaddr + phdr->p_memsz;
+			if (phdr->p_vaddr < min_vaddr)
+				min_vaddr = phdr->p_vaddr;
+		}
+	}
+
+	if ((min_vaddr == 0xffffffff) && (max_vaddr == 0)) {
+		DL_ERR("%5d - No loadable segments found in %s.", apkenv_pid, name);
+		return (intptr_t)-1;
+	}
+
+	/* truncate min_vaddr down to page boundary */
+	min_vaddr &= ~PAGE_MASK;
+
+	/* round max_vaddr up to the next page */
+	max_vaddr = (max_vaddr + PAGE_SIZE - 1) & ~PAGE_MASK;
+
+	*total_sz = (max_vaddr - min_vaddr);
+	return (intptr_t)req_base;
+}
+
+/* apkenv_reserve_mem_region
+ *
+ *     This function reserves a chunk of memory to be used for mapping in
+ *     a prelinked shared library. We reserve the entire memory region here, and
+ *     then the rest of the linker will relocate the individual loadable
+ *     segments into the correct locations within this memory range.
+ *
+ * Args:
+ *     si->base: The requested base of the allocation.
+ *     si->size: The size of the allocation.
+ *
+ * Returns:
+ *     -1 on failure, and 0 on success.  On success, si->base will contain
+ *     the virtual address at which the library will be mapped.
+ */
+
+static int apkenv_reserve_mem_region(soinfo *si)
+{
+	void *base = mmap((void *)si->base, si->size, PROT_NONE,
+			  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		DL_ERR("%5d can NOT map (%sprelinked) library '%s' at 0x%016lx "
+		       "as requested, will try general pool: %d (%s)",
+		       apkenv_pid, (si->base ? "" : "non-"), si->name, si->base,
+		       errno, strerror(errno));
+		return -1;
+	} else if (base != (void *)si->base) {
+		DL_ERR("OOPS: %5d %sprelinked library '%s' mapped at 0x%016lx, "
+		       "not at 0x%016lx",
+		       apkenv_pid, (si->base ? "" : "non-"),
+		       si->name, (intptr_t)base, si->base);
+		munmap(base, si->size);
+		return -1;
+	}
+	return 0;
+}
+
+/* Per-library paging policy for the mapped segments, so that startup
+ * critical libraries don't have to be faulted in 4 KiB at a time. Each
+ * policy is a list of fnmatch() patterns for library names, taken from an
+ * environment variable (separated by ':') and from `@<keyword> <pattern>...`
+ * lines in cfg.d:
+ *   BIONIC_LD_POPULATE, @populate: prefault the text with MAP_POPULATE
+ *   BIONIC_LD_WILLNEED, @willneed: start readahead for all segments
+ *   BIONIC_LD_HUGEPAGE, @hugepage: MADV_HUGEPAGE all segments
+ *   BIONIC_LD_THP_TEXT, @thp-text: put the text in huge pages (see
+ *                                  apkenv_thp_text())
+ *   BIONIC_LD_TRIM, @trim: drop link-time only metadata after linking (see
+ *                          apkenv_trim_relocations())
+ *   BIONIC_LD_MERGE, @merge: make relocated data mergeable by KSM (see
+ *                            apkenv_merge_segments())
+ * All of them are off unless asked for. */
+#define LOAD_POPULATE 0x1
+#define LOAD_WILLNEED 0x2
+#define LOAD_HUGEPAGE 0x4
+#define LOAD_THP_TEXT 0x8
+#define LOAD_TRIM 0x10
+#define LOAD_MERGE 0x20
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Optional arena for the libraries: with BIONIC_LD_ARENA=<size>[KMG], one
+ * PROT_NONE region of that size is reserved on the first load and libraries
+ * are packed into it back to back, in load order, instead of wherever the
+ * kernel puts them. This keeps the libraries together, away from the heap and
+ * the other mappings, and gives them the same addresses from run to run as
+ * long as the load order stays the same. It only decides where a library
+ * goes, not how it's mapped: each segment is still a mapping of its own (as
+ * is its bss), and the unused rest of the arena is one more. Unloaded
+ * libraries leave a hole that is reused first-fit; if the arena is full, we
+ * fall back to the kernel allocator.
+ * BIONIC_LD_ARENA_BASE=<address> puts the arena at a fixed address, so that
+ * every process gets the same library bases (and thus byte-identical
+ * relocated data, see apkenv_merge_segments()). */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define ARENA_HOLES_MAX 64
+
+static struct {
+	uintptr_t start, end, top;
+	struct {
+		uintptr_t start, end;
+	} holes[ARENA_HOLES_MAX];
+	size_t holes_count;
+	bool initialized;
+} apkenv_arena;
+
+static size_t apkenv_parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G': size <<= 10; /* fallthrough */
+	case 'm': case 'M': size <<= 10; /* fallthrough */
+	case 'k': case 'K': size <<= 10;
+	}
+	return size;
+}
+
+static bool apkenv_arena_init(void)
+{
+	if (apkenv_arena.initialized)
+		return apkenv_arena.start != 0;
+	apkenv_arena.initialized = true;
+
+	const char *env = getenv("BIONIC_LD_ARENA");
+	size_t size = env ? apkenv_parse_size(env) : 0;
+	size = (size + PAGE_SIZE - 1) & ~PAGE_MASK;
+	if (!size)
+		return false;
+
+	const char *base_env = getenv("BIONIC_LD_ARENA_BASE");
+	uintptr_t fixed = base_env ? strtoull(base_env, NULL, 0) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1) : 0;
+	if (fixed) {
+		void *base = mmap((void *)fixed, size, PROT_NONE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+		if (base == (void *)fixed) {
+			apkenv_arena.start = apkenv_arena.top = fixed;
+			apkenv_arena.end = fixed + size;
+			PRINT("%5d reserved library arena %016lx-%016lx\n",
+			      apkenv_pid, apkenv_arena.start, apkenv_arena.end);
+			return true;
+		}
+		if (base != MAP_FAILED)
+			munmap(base, size);
+		DL_ERR("%5d could not reserve the library arena at 0x%016lx, "
+		       "library bases won't be deterministic", apkenv_pid, fixed);
+	}
+
+	/* over-reserve so that the arena starts at a huge page boundary */
+	void *base = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		DL_ERR("%5d could not reserve %zu bytes for the library arena: %d (%s)",
+		       apkenv_pid, size, errno, strerror(errno));
+		return false;
+	}
+
+	uintptr_t start = ((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+	if (start > (uintptr_t)base)
+		munmap(base, start - (uintptr_t)base);
+	if ((uintptr_t)base + HUGE_PAGE_SIZE > start)
+		munmap((void *)(start + size), (uintptr_t)base + HUGE_PAGE_SIZE - start);
+
+	apkenv_arena.start = apkenv_arena.top = start;
+	apkenv_arena.end = start + size;
+	PRINT("%5d reserved library arena %016lx-%016lx\n",
+	      apkenv_pid, apkenv_arena.start, apkenv_arena.end);
+	return true;
+}
+
+static uintptr_t apkenv_arena_alloc(size_t size, size_t align)
+{
+	if (!apkenv_arena_init())
+		return 0;
+
+	for (size_t i = 0; i < apkenv_arena.holes_count; i++) {
+		uintptr_t start = (apkenv_arena.holes[i].start + align - 1) & ~(uintptr_t)(align - 1);
+		uintptr_t end = apkenv_arena.holes[i].end;
+		if (start >= end || end - start < size)
+			continue;
+		if (start > apkenv_arena.holes[i].start && start + size < end) {
+			/* would split the hole in two */
+			if (apkenv_arena.holes_count == ARENA_HOLES_MAX)
+				continue;
+			apkenv_arena.holes[apkenv_arena.holes_count].start = start + size;
+			apkenv_arena.holes[apkenv_arena.holes_count].end = end;
+			apkenv_arena.holes_count++;
+			apkenv_arena.holes[i].end = start;
+		} else if (start > apkenv_arena.holes[i].start) {
+			apkenv_arena.holes[i].end = start;
+		} else if (start + size < end) {
+			apkenv_arena.holes[i].start = start + size;
+		} else {
+			apkenv_arena.holes[i] = apkenv_arena.holes[--apkenv_arena.holes_count];
+		}
+		return start;
+	}
+
+	uintptr_t start = (apkenv_arena.top + align - 1) & ~(uintptr_t)(align - 1);
+	if (start > apkenv_arena.end || apkenv_arena.end - start < size)
+		return 0;
+	if (start > apkenv_arena.top && apkenv_arena.holes_count < ARENA_HOLES_MAX) {
+		apkenv_arena.holes[apkenv_arena.holes_count].start = apkenv_arena.top;
+		apkenv_arena.holes[apkenv_arena.holes_count].end = start;
+		apkenv_arena.holes_count++;
+	}
+	apkenv_arena.top = start + size;
+	return start;
+}
+
+static bool apkenv_arena_free(uintptr_t start, size_t size)
+{
+	if (start < apkenv_arena.start || start >= apkenv_arena.end)
+		return false;
+
+	/* put the reservation back in place, this also drops the pages */
+	mmap((void *)start, size, PROT_NONE,
+	     MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	/* a merge makes the range touch holes that were checked before it, so
+	 * go over them again until nothing merges anymore */
+	uintptr_t end = start + size;
+	for (size_t i = 0; i < apkenv_arena.holes_count;) {
+		if (apkenv_arena.holes[i].end == start || apkenv_arena.holes[i].start == end) {
+			start = MIN(start, apkenv_arena.holes[i].start);
+			end = MAX(end, apkenv_arena.holes[i].end);
+			apkenv_arena.holes[i] = apkenv_arena.holes[--apkenv_arena.holes_count];
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+
+	if (end == apkenv_arena.top)
+		apkenv_arena.top = start;
+	else if (apkenv_arena.holes_count < ARENA_HOLES_MAX) {
+		apkenv_arena.holes[apkenv_arena.holes_count].start = start;
+		apkenv_arena.holes[apkenv_arena.holes_count].end = end;
+		apkenv_arena.holes_count++;
+	}
+	/* else the range just stays reserved */
+	return true;
+}
+
+static int apkenv_alloc_mem_region(soinfo *si)
+{
+	if (si->base) {
+		/* Attempt to mmap a prelinked library. */
+		return apkenv_reserve_mem_region(si);
+	}
+
+	bool align = si->load_policy & LOAD_THP_TEXT;
+	uintptr_t start = apkenv_arena_alloc(si->size, align ? HUGE_PAGE_SIZE : PAGE_SIZE);
+	if (start) {
+		si->base = start;
+		PRINT("%5d mapped library '%s' to %016lx in the arena.\n",
+		      apkenv_pid, si->name, si->base);
+		return 0;
+	}
+
+	/* This is not a prelinked library, so we use the kernel's default
+	   allocator. For huge page backed text we over-allocate so that we
+	   can put the library at a huge page boundary.
+	*/
+	size_t len = si->size + (align ? HUGE_PAGE_SIZE - PAGE_SIZE : 0);
+
+	void *base = mmap(NULL, len, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		DL_ERR("%5d mmap of library '%s' failed: %d (%s)\n",
+		       apkenv_pid, si->name,
+		       errno, strerror(errno));
+		goto err;
+	}
+	if (align) {
+		uintptr_t aligned = ((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+		if (aligned > (uintptr_t)base)
+			munmap(base, aligned - (uintptr_t)base);
+		if ((uintptr_t)base + len > aligned + si->size)
+			munmap((void *)(aligned + si->size), (uintptr_t)base + len - (aligned + si->size));
+		base = (void *)aligned;
+	}
+	si->base = (intptr_t)base;
+	PRINT("%5d mapped library '%s' to %016lx via kernel allocator.\n",
+	      apkenv_pid, si->name, si->base);
+	return 0;
+
+err:
+	DL_ERR("OOPS: %5d cannot map library '%s'. no vspace available.",
+	       apkenv_pid, si->name);
+	return -1;
+}
+
+static void apkenv_free_mem_region(soinfo *si)
+{
+	if (!apkenv_arena_free(si->base, si->size))
+		munmap((void *)si->base, si->size);
+}
+
+#define MAYBE_MAP_FLAG(x, from, to) (((x) & (from)) ? (to) : 0)
+#define PFLAGS_TO_PROT(x)	    (MAYBE_MAP_FLAG((x), PF_X, PROT_EXEC) | \
+			   MAYBE_MAP_FLAG((x), PF_R, PROT_READ) |           \
+			   MAYBE_MAP_FLAG((x), PF_W, PROT_WRITE))
+
+static struct dl_loader_stats apkenv_loader_stats;
+
+void apkenv_get_loader_stats(struct dl_loader_stats *stats)
+{
+	*stats = apkenv_loader_stats;
+}
+
+static bool apkenv_name_matches_list(const char *list, const char *delims, const char *name)
+{
+	char pattern[256];
+
+	while (*list) {
+		list += strspn(list, delims);
+		size_t len = strcspn(list, delims);
+		if (len && len < sizeof(pattern)) {
+			memcpy(pattern, list, len);
+			pattern[len] = '\0';
+			if (!fnmatch(pattern, name, 0))
+				return true;
+		}
+		list += len;
+	}
+
+	return false;
+}
+
+static bool apkenv_load_policy_matches(const char *env, const char *keyword, const char *default_list, const char *name)
+{
+	const char *list = getenv(env) ?: default_list;
+	const char *directive;
+	size_t iter = 0;
+
+	if (apkenv_name_matches_list(list, ":", name))
+		return true;
+
+	while ((directive = cfg_directive(keyword, &iter))) {
+		if (apkenv_name_matches_list(directive, " \t", name))
+			return true;
+	}
+
+	return false;
+}
+
+static bool apkenv_pgprof_recording(void);
+
+static unsigned apkenv_load_policy(const char *name)
+{
+	unsigned policy = 0;
+
+	if (apkenv_load_policy_matches("BIONIC_LD_POPULATE", "populate", "", name))
+		policy |= LOAD_POPULATE;
+	if (apkenv_load_policy_matches("BIONIC_LD_WILLNEED", "willneed", "", name))
+		policy |= LOAD_WILLNEED;
+	if (apkenv_load_policy_matches("BIONIC_LD_HUGEPAGE", "hugepage", "", name))
+		policy |= LOAD_HUGEPAGE;
+	if (apkenv_load_policy_matches("BIONIC_LD_THP_TEXT", "thp-text", "", name))
+		policy |= LOAD_THP_TEXT;
+	if (apkenv_load_policy_matches("BIONIC_LD_TRIM", "trim", "", name))
+		policy |= LOAD_TRIM;
+	if (apkenv_load_policy_matches("BIONIC_LD_MERGE", "merge", "", name))
+		policy |= LOAD_MERGE;
+
+	/* a page access profile recorded after reading (or faulting) in the
+	 * whole library would just be the whole library */
+	if (apkenv_pgprof_recording())
+		policy &= ~(LOAD_POPULATE | LOAD_WILLNEED);
+
+	return policy;
+}
+
+static void apkenv_apply_load_policy(unsigned policy, void *addr, size_t len, bool populated)
+{
+	if (populated)
+		apkenv_loader_stats.prefaulted_pages += (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	else if ((policy & LOAD_WILLNEED) && !madvise(addr, len, MADV_WILLNEED))
+		apkenv_loader_stats.readahead_pages += (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if ((policy & LOAD_HUGEPAGE) && !madvise(addr, len, MADV_HUGEPAGE))
+		apkenv_loader_stats.hugepage_advised_bytes += len;
+}
+
+/* Trimming of link-time metadata (LOAD_TRIM): once a library is linked,
+ * its relocation tables are never read again, and the hash tables of a
+ * library nobody calls dlsym() on are only needed by libraries loaded later.
+ * Both live in read-only file mappings, so their pages can be dropped and
+ * will simply be faulted back in from the file should they be needed. Pages
+ * of a library with text relocations may have been written to, so for those
+ * we only use MADV_COLD. */
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+
+struct apkenv_trim_range {
+	uintptr_t start, end;
+};
+
+static int apkenv_trim_range_cmp(const void *a, const void *b)
+{
+	const struct apkenv_trim_range *ra = a, *rb = b;
+	return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+static void apkenv_trim_segment(soinfo *si, uintptr_t start, uintptr_t end)
+{
+	const ElfW(Phdr) *phdr = si->phdr;
+
+	for (size_t i = 0; i < si->phnum; i++, phdr++) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		uintptr_t seg_start = si->base + phdr->p_vaddr;
+		uintptr_t seg_end = seg_start + phdr->p_filesz;
+		if (start < seg_start || start >= seg_end)
+			continue;
+		/* writable data isn't refaultable, and huge page text may be an
+		 * anonymous copy */
+		if ((phdr->p_flags & PF_W) ||
+		    ((phdr->p_flags & PF_X) && (si->load_policy & LOAD_THP_TEXT)))
+			return;
+
+		start = (start + PAGE_SIZE - 1) & ~PAGE_MASK;
+		end = MIN(end, seg_end) & ~PAGE_MASK;
+		if (start >= end)
+			return;
+
+		if (!(si->flags & FLAG_TEXTREL)) {
+			if (!madvise((void *)start, end - start, MADV_DONTNEED))
+				apkenv_loader_stats.trimmed_bytes += end - start;
+		} else if (!madvise((void *)start, end - start, MADV_COLD)) {
+			apkenv_loader_stats.trimmed_cold_bytes += end - start;
+		}
+		TRACE("[ %5d trimmed %016lx-%016lx of '%s' ]\n",
+		      apkenv_pid, start, end, si->name);
+		return;
+	}
+}
+
+static void apkenv_trim_ranges(soinfo *si, struct apkenv_trim_range *ranges, size_t count)
+{
+	qsort(ranges, count, sizeof(ranges[0]), apkenv_trim_range_cmp);
+
+	/* tables that are less than a page apart are trimmed together */
+	for (size_t i = 0; i < count;) {
+		uintptr_t start = ranges[i].start, end = ranges[i].end;
+		for (i++; i < count && ranges[i].start < end + PAGE_SIZE; i++)
+			end = MAX(end, ranges[i].end);
+		apkenv_trim_segment(si, start, end);
+	}
+}
+
+static void apkenv_trim_relocations(soinfo *si)
+{
+	struct apkenv_trim_range ranges[3];
+	size_t count = 0;
+
+	if (!(si->load_policy & LOAD_TRIM))
+		return;
+
+#if defined(USE_RELA)
+	if (si->plt_rela_count)
+		ranges[count++] = (struct apkenv_trim_range){(uintptr_t)si->plt_rela, (uintptr_t)(si->plt_rela + si->plt_rela_count)};
+	if (si->rela_count)
+		ranges[count++] = (struct apkenv_trim_range){(uintptr_t)si->rela, (uintptr_t)(si->rela + si->rela_count)};
+#else
+	if (si->plt_rel_count)
+		ranges[count++] = (struct apkenv_trim_range){(uintptr_t)si->plt_rel, (uintptr_t)(si->plt_rel + si->plt_rel_count)};
+	if (si->rel_count)
+		ranges[count++] = (struct apkenv_trim_range){(uintptr_t)si->rel, (uintptr_t)(si->rel + si->rel_count)};
+#endif
+	if (si->relr_count_)
+		ranges[count++] = (struct apkenv_trim_range){(uintptr_t)si->relr_, (uintptr_t)(si->relr_ + si->relr_count_)};
+
+	apkenv_trim_ranges(si, ranges, count);
+}
+
+static void apkenv_trim_hash_table(soinfo *si)
+{
+	struct apkenv_trim_range range;
+
+	if (si->flags & FLAG_GNU_HASH) {
+		/* the chain has no explicit length: it ends after the last
+		 * entry of the bucket that starts the highest */
+		uint32_t last = 0;
+		for (size_t i = 0; i < si->nbucket; i++)
+			last = MAX(last, si->bucket[i]);
+		const uint32_t *end = si->bucket + si->nbucket;
+		if (last) {
+			while (!(si->chain[last] & 1))
+				last++;
+			end = &si->chain[last + 1];
+		}
+		range.start = (uintptr_t)si->gnu_bloom_filter - 16;
+		range.end = (uintptr_t)end;
+	} else if (si->nbucket) {
+		range.start = (uintptr_t)(si->bucket - 2);
+		range.end = (uintptr_t)(si->chain + si->nchain);
+	} else {
+		return;
+	}
+
+	apkenv_trim_ranges(si, &range, 1);
+}
+
+void apkenv_trim_hash_tables(soinfo *except)
+{
+	for (soinfo *si = apkenv_solist; si; si = si->next) {
+		if (si == except || !(si->load_policy & LOAD_TRIM) ||
+		    (si->flags & (FLAG_DLSYM | FLAG_HASH_TRIMMED | FLAG_ERROR)) ||
+		    !(si->flags & FLAG_LINKED))
+			continue;
+		apkenv_trim_hash_table(si);
+		si->flags |= FLAG_HASH_TRIMMED;
+	}
+}
+
+/* KSM for relocated data (LOAD_MERGE): when many instances of the same app
+ * run on one host with the same library bases (BIONIC_LD_ARENA_BASE), the
+ * writable segments (.data, .got, RELRO) come out of relocation identical in
+ * all of them. Advise them MADV_MERGEABLE so that the kernel can share the
+ * pages between the processes. BIONIC_LD_MERGE_PROCESS=1 additionally opts
+ * the whole process in with PR_SET_MEMORY_MERGE (Linux 6.4+). */
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
+
+static void apkenv_merge_segments(soinfo *si)
+{
+	static bool process_merge_done;
+	const ElfW(Phdr) *phdr = si->phdr;
+
+	if (!(si->load_policy & LOAD_MERGE))
+		return;
+
+	if (!process_merge_done) {
+		const char *env = getenv("BIONIC_LD_MERGE_PROCESS");
+		process_merge_done = true;
+		if (env && atoi(env) && prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0)
+			DL_ERR("%5d PR_SET_MEMORY_MERGE failed: %d (%s)",
+			       apkenv_pid, errno, strerror(errno));
+	}
+
+	for (size_t i = 0; i < si->phnum; i++, phdr++) {
+		if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_W))
+			continue;
+		uintptr_t start = (si->base + phdr->p_vaddr) & ~PAGE_MASK;
+		uintptr_t end = (si->base + phdr->p_vaddr + phdr->p_memsz + PAGE_SIZE - 1) & ~PAGE_MASK;
+		if (!madvise((void *)start, end - start, MADV_MERGEABLE))
+			apkenv_loader_stats.merge_advised_bytes += end - start;
+		else
+			DEBUG("%5d MADV_MERGEABLE of '%s' failed: %d (%s)\n",
+			      apkenv_pid, si->name, errno, strerror(errno));
+	}
+}
+
+/* Page access profiles, for libraries too big for blanket readahead to be a
+ * good idea: with BIONIC_LD_PGPROF_RECORD=<seconds>, a thread samples (with
+ * mincore()) which pages of the libraries' file mappings are resident until
+ * that many seconds after the first library was loaded, and then writes them
+ * out as <library>.pgprof (or to the cache dir if that's not writable).
+ * Loading a library for which a profile matching its size and mtime exists
+ * starts readahead for exactly those pages. Note that mincore() reports page
+ * cache residency, so a profile is only as good as the page cache was cold
+ * while recording it, which is also why the populate and willneed policies
+ * are ignored then. BIONIC_LD_PGPROF_REPLAY=0 turns replaying off. */
+#define PGPROF_MAGIC "BTPGPRF1"
+#define PGPROF_MAX_LIBS 64
+#define PGPROF_MAX_SEGMENTS 8
+#define PGPROF_SAMPLE_INTERVAL_MS 100
+
+struct pgprof_header {
+	char magic[8];
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t nranges;
+	uint32_t reserved;
+};
+
+struct pgprof_range {
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct apkenv_pgprof {
+	char path[SOINFO_NAME_LEN];
+	ElfW(Addr) base; /* 0 once the library is unloaded */
+	struct stat st;
+	size_t nsegments;
+	struct {
+		unsigned char *addr;
+		size_t len;
+		off_t offset;
+		unsigned char *seen; /* a byte per page, like mincore() */
+	} segments[PGPROF_MAX_SEGMENTS];
+};
+
+static pthread_mutex_t apkenv_pgprof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct apkenv_pgprof apkenv_pgprofs[PGPROF_MAX_LIBS];
+static size_t apkenv_pgprof_count = 0;
+static long apkenv_pgprof_record_secs = -1; /* -1: BIONIC_LD_PGPROF_RECORD not read yet */
+static bool apkenv_pgprof_written = false;
+
+/* <fullpath>.pgprof, or <cache dir>/pgprof/<name>-<hash of fullpath>.pgprof */
+static char *apkenv_pgprof_path(const char *fullpath, bool in_cache, bool create_dir)
+{
+	char *path = NULL;
+
+	if (!in_cache) {
+		if (asprintf(&path, "%s.pgprof", fullpath) < 0)
+			return NULL;
+		return path;
+	}
+
+	char *dir = cfg_cache_dir(create_dir);
+	if (!dir)
+		return NULL;
+
+	const char *bname = strrchr(fullpath, '/');
+	uint32_t h = 5381;
+	for (const char *c = fullpath; *c; c++)
+		h = h * 33 + (unsigned char)*c;
+
+	if (create_dir) {
+		char *pgprof_dir;
+		if (asprintf(&pgprof_dir, "%s/pgprof", dir) >= 0) {
+			mkdir(pgprof_dir, 0700);
+			free(pgprof_dir);
+		}
+	}
+
+	if (asprintf(&path, "%s/pgprof/%s-%08x.pgprof", dir, bname ? bname + 1 : fullpath, h) < 0)
+		path = NULL;
+	free(dir);
+	return path;
+}
+
+static void apkenv_pgprof_replay(int fd, const struct stat *st, const char *fullpath)
+{
+	const char *replay = getenv("BIONIC_LD_PGPROF_REPLAY");
+	if (replay && !strcmp(replay, "0"))
+		return;
+
+	for (int in_cache = 0; in_cache < 2; in_cache++) {
+		struct pgprof_header hdr;
+		struct pgprof_range ranges[256];
+
+		char *path = apkenv_pgprof_path(fullpath, in_cache, false);
+		if (!path)
+			continue;
+		int pfd = open(path, O_RDONLY | O_CLOEXEC);
+		free(path);
+		if (pfd < 0)
+			continue;
+
+		if (read(pfd, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, PGPROF_MAGIC, sizeof(hdr.magic)) ||
+		    hdr.file_size != (uint64_t)st->st_size || hdr.mtime_sec != st->st_mtim.tv_sec || hdr.mtime_nsec != st->st_mtim.tv_nsec) {
+			close(pfd);
+			continue;
+		}
+
+		uint32_t left = hdr.nranges;
+		ssize_t n;
+		while (left && (n = read(pfd, ranges, MIN(left, 256) * sizeof(ranges[0]))) >= (ssize_t)sizeof(ranges[0])) {
+			for (size_t i = 0; i < n / sizeof(ranges[0]); i++) {
+				posix_fadvise(fd, ranges[i].offset, ranges[i].length, POSIX_FADV_WILLNEED);
+				apkenv_loader_stats.profile_replayed_pages += ranges[i].length / PAGE_SIZE;
+			}
+			left -= n / sizeof(ranges[0]);
+		}
+
+		TRACE("[ %5d replayed page profile of '%s' (%u ranges) ]\n", apkenv_pid, fullpath, hdr.nranges - left);
+		close(pfd);
+		return;
+	}
+}
+
+static bool apkenv_pgprof_write_file(const char *path, const void *buf, size_t len)
+{
+	char *tmp_path;
+	if (asprintf(&tmp_path, "%s.%d.tmp", path, getpid()) < 0)
+		return false;
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		free(tmp_path);
+		return false;
+	}
 
-	TRACE("[ %5d Computing extents for '%s'. ]\n", apkenv_pid, name);
-	if (apkenv_verify_elf_object(_hdr, name) < 0) {
-		DL_ERR("%5d - %s is not a valid ELF object", apkenv_pid, name);
-		return (intptr_t)-1;
+	bool ok = write(fd, buf, len) == (ssize_t)len;
+	close(fd);
+	if (!ok || rename(tmp_path, path) < 0) {
+		unlink(tmp_path);
+		ok = false;
 	}
+	free(tmp_path);
+	return ok;
+}
 
-	req_base = (intptr_t)apkenv_is_prelinked(fd, name);
-	if (req_base == (intptr_t)-1)
-		return -1;
-	else if (req_base != 0) {
-		TRACE("[ %5d - Prelinked library '%s' requesting base @ 0x%016lx ]\n",
-		      apkenv_pid, name, req_base);
-	} else {
-		TRACE("[ %5d - Non-prelinked library '%s' found. ]\n", apkenv_pid, name);
+static void apkenv_pgprof_write(struct apkenv_pgprof *p)
+{
+	size_t nranges = 0, max_ranges = 0;
+
+	for (size_t i = 0; i < p->nsegments; i++)
+		max_ranges += (p->segments[i].len / PAGE_SIZE + 2) / 2;
+
+	struct pgprof_header *hdr = calloc(1, sizeof(*hdr) + max_ranges * sizeof(struct pgprof_range));
+	if (!hdr)
+		return;
+	struct pgprof_range *ranges = (struct pgprof_range *)(hdr + 1);
+
+	for (size_t i = 0; i < p->nsegments; i++) {
+		size_t pages = (p->segments[i].len + PAGE_SIZE - 1) / PAGE_SIZE;
+		for (size_t page = 0; page < pages; page++) {
+			if (!p->segments[i].seen[page])
+				continue;
+			size_t first = page;
+			while (page + 1 < pages && p->segments[i].seen[page + 1])
+				page++;
+			ranges[nranges].offset = p->segments[i].offset + first * PAGE_SIZE;
+			ranges[nranges].length = (page - first + 1) * PAGE_SIZE;
+			nranges++;
+		}
 	}
 
-	phdr = (ElfW(Phdr) *)(_hdr + ehdr->e_phoff);
+	memcpy(hdr->magic, PGPROF_MAGIC, sizeof(hdr->magic));
+	hdr->file_size = p->st.st_size;
+	hdr->mtime_sec = p->st.st_mtim.tv_sec;
+	hdr->mtime_nsec = p->st.st_mtim.tv_nsec;
+	hdr->nranges = nranges;
+
+	size_t len = sizeof(*hdr) + nranges * sizeof(struct pgprof_range);
+	for (int in_cache = 0; in_cache < 2; in_cache++) {
+		char *path = apkenv_pgprof_path(p->path, in_cache, true);
+		bool ok = path && apkenv_pgprof_write_file(path, hdr, len);
+		if (ok)
+			TRACE("[ %5d wrote page profile '%s' (%zu ranges) ]\n", apkenv_pid, path, nranges);
+		free(path);
+		if (ok)
+			break;
+	}
+	free(hdr);
+}
 
-	/* find the min/max p_vaddrs from all the PT_LOAD segments so we can
-	 * get the range. */
-	for (cnt = 0; cnt < ehdr->e_phnum; ++cnt, ++phdr) {
-		if (phdr->p_type == PT_LOAD) {
-			if ((phdr->p_vaddr + phdr->p_memsz) > max_vaddr)
-				max_vaddr = phdr->p_vaddr + phdr->p_memsz;
-			if (phdr->p_vaddr < min_vaddr)
-				min_vaddr = phdr->p_vaddr;
+static void apkenv_pgprof_sample_locked(unsigned char **vec, size_t *vec_len)
+{
+	for (size_t i = 0; i < apkenv_pgprof_count; i++) {
+		struct apkenv_pgprof *p = &apkenv_pgprofs[i];
+		if (!p->base)
+			continue;
+		for (size_t j = 0; j < p->nsegments; j++) {
+			size_t pages = (p->segments[j].len + PAGE_SIZE - 1) / PAGE_SIZE;
+			if (pages > *vec_len) {
+				unsigned char *tmp = realloc(*vec, pages);
+				if (!tmp)
+					continue;
+				*vec = tmp;
+				*vec_len = pages;
+			}
+			if (mincore(p->segments[j].addr, p->segments[j].len, *vec) < 0)
+				continue;
+			for (size_t page = 0; page < pages; page++)
+				p->segments[j].seen[page] |= (*vec)[page] & 1;
 		}
 	}
+}
 
-	if ((min_vaddr == 0xffffffff) && (max_vaddr == 0)) {
-		DL_ERR("%5d - No loadable segments found in %s.", apkenv_pid, name);
-		return (intptr_t)-1;
+/* called from the sampler once the time is up, or at exit if that's sooner */
+static void apkenv_pgprof_finish(void)
+{
+	unsigned char *vec = NULL;
+	size_t vec_len = 0;
+
+	pthread_mutex_lock(&apkenv_pgprof_lock);
+	if (!apkenv_pgprof_written) {
+		apkenv_pgprof_sample_locked(&vec, &vec_len);
+		apkenv_pgprof_written = true;
+		for (size_t i = 0; i < apkenv_pgprof_count; i++)
+			apkenv_pgprof_write(&apkenv_pgprofs[i]);
 	}
+	pthread_mutex_unlock(&apkenv_pgprof_lock);
+	free(vec);
+}
 
-	/* truncate min_vaddr down to page boundary */
-	min_vaddr &= ~PAGE_MASK;
+static void *apkenv_pgprof_sampler(void *arg)
+{
+	struct timespec start, now;
+	unsigned char *vec = NULL;
+	size_t vec_len = 0;
 
-	/* round max_vaddr up to the next page */
-	max_vaddr = (max_vaddr + PAGE_SIZE - 1) & ~PAGE_MASK;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		pthread_mutex_lock(&apkenv_pgprof_lock);
+		bool written = apkenv_pgprof_written;
+		if (!written)
+			apkenv_pgprof_sample_locked(&vec, &vec_len);
+		pthread_mutex_unlock(&apkenv_pgprof_lock);
+		if (written)
+			break;
 
-	*total_sz = (max_vaddr - min_vaddr);
-	return (intptr_t)req_base;
+		nanosleep(&(struct timespec){ .tv_nsec = PGPROF_SAMPLE_INTERVAL_MS * 1000000 }, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec - start.tv_sec < apkenv_pgprof_record_secs);
+
+	free(vec);
+	apkenv_pgprof_finish();
+	return NULL;
 }
 
-/* apkenv_reserve_mem_region
- *
- *     This function reserves a chunk of memory to be used for mapping in
- *     a prelinked shared library. We reserve the entire memory region here, and
- *     then the rest of the linker will relocate the individual loadable
- *     segments into the correct locations within this memory range.
- *
- * Args:
- *     si->base: The requested base of the allocation.
- *     si->size: The size of the allocation.
- *
- * Returns:
- *     -1 on failure, and 0 on success.  On success, si->base will contain
- *     the virtual address at which the library will be mapped.
- */
+static void apkenv_pgprof_record(const struct stat *st, soinfo *si)
+{
+	pthread_mutex_lock(&apkenv_pgprof_lock);
+	if (apkenv_pgprof_written || apkenv_pgprof_count == PGPROF_MAX_LIBS) {
+		pthread_mutex_unlock(&apkenv_pgprof_lock);
+		return;
+	}
 
-static int apkenv_reserve_mem_region(soinfo *si)
+	struct apkenv_pgprof *p = &apkenv_pgprofs[apkenv_pgprof_count];
+	memset(p, 0, sizeof(*p));
+	apkenv_strlcpy(p->path, si->fullpath, sizeof(p->path));
+	p->base = si->base;
+	p->st = *st;
+
+	for (size_t i = 0; i < si->phnum && p->nsegments < PGPROF_MAX_SEGMENTS; i++) {
+		ElfW(Phdr) *phdr = &si->phdr[i];
+		if (phdr->p_type != PT_LOAD || !phdr->p_filesz)
+			continue;
+		size_t len = phdr->p_filesz + (phdr->p_vaddr & PAGE_MASK);
+		unsigned char *seen = calloc((len + PAGE_SIZE - 1) / PAGE_SIZE, 1);
+		if (!seen)
+			continue;
+		p->segments[p->nsegments].addr = (unsigned char *)(si->base + (phdr->p_vaddr & ~PAGE_MASK));
+		p->segments[p->nsegments].len = len;
+		p->segments[p->nsegments].offset = phdr->p_offset & ~PAGE_MASK;
+		p->segments[p->nsegments].seen = seen;
+		p->nsegments++;
+	}
+
+	if (apkenv_pgprof_count++ == 0) {
+		pthread_t thread;
+		if (!pthread_create(&thread, NULL, apkenv_pgprof_sampler, NULL))
+			pthread_detach(thread);
+		atexit(apkenv_pgprof_finish);
+	}
+	pthread_mutex_unlock(&apkenv_pgprof_lock);
+}
+
+static bool apkenv_pgprof_recording(void)
 {
-	void *base = mmap((void *)si->base, si->size, PROT_NONE,
-			  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (base == MAP_FAILED) {
-		DL_ERR("%5d can NOT map (%sprelinked) library '%s' at 0x%016lx "
-		       "as requested, will try general pool: %d (%s)",
-		       apkenv_pid, (si->base ? "" : "non-"), si->name, si->base,
-		       errno, strerror(errno));
-		return -1;
-	} else if (base != (void *)si->base) {
-		DL_ERR("OOPS: %5d %sprelinked library '%s' mapped at 0x%016lx, "
-		       "not at 0x%016lx",
-		       apkenv_pid, (si->base ? "" : "non-"),
-		       si->name, (intptr_t)base, si->base);
-		munmap(base, si->size);
-		return -1;
+	if (apkenv_pgprof_record_secs == -1) {
+		const char *env = getenv("BIONIC_LD_PGPROF_RECORD");
+		apkenv_pgprof_record_secs = env ? MAX(strtol(env, NULL, 10), 0) : 0;
 	}
-	return 0;
+	return apkenv_pgprof_record_secs > 0;
 }
 
-static int apkenv_alloc_mem_region(soinfo *si)
+/* called once a library's segments are mapped */
+static void apkenv_pgprof_load(int fd, soinfo *si)
 {
-	if (si->base) {
-		/* Attempt to mmap a prelinked library. */
-		return apkenv_reserve_mem_region(si);
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return;
+
+	/* replaying while recording would just record the replayed pages */
+	if (apkenv_pgprof_recording())
+		apkenv_pgprof_record(&st, si);
+	else
+		apkenv_pgprof_replay(fd, &st, si->fullpath);
+}
+
+static void apkenv_pgprof_unload(soinfo *si)
+{
+	if (apkenv_pgprof_record_secs <= 0)
+		return;
+
+	unsigned char *vec = NULL;
+	size_t vec_len = 0;
+
+	pthread_mutex_lock(&apkenv_pgprof_lock);
+	if (!apkenv_pgprof_written)
+		apkenv_pgprof_sample_locked(&vec, &vec_len);
+	for (size_t i = 0; i < apkenv_pgprof_count; i++) {
+		if (apkenv_pgprofs[i].base == si->base)
+			apkenv_pgprofs[i].base = 0;
+	}
+	pthread_mutex_unlock(&apkenv_pgprof_lock);
+	free(vec);
+}
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+/* sums up AnonHugePages and FilePmdMapped of the mappings in [start, end) */
+static size_t apkenv_smaps_huge_bytes(uintptr_t start, uintptr_t end)
+{
+	char *line = NULL;
+	size_t line_len = 0, total = 0;
+	bool in_range = false;
+	unsigned long vm_start, vm_end, kb;
+
+	FILE *smaps = fopen("/proc/self/smaps", "re");
+	if (!smaps)
+		return 0;
+
+	while (getline(&line, &line_len, smaps) > 0) {
+		if (sscanf(line, "%lx-%lx ", &vm_start, &vm_end) == 2 && strchr(line, '-') < strchr(line, ' '))
+			in_range = vm_start < end && vm_end > start;
+		else if (in_range && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+		                      sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1))
+			total += kb * 1024;
 	}
 
-	/* This is not a prelinked library, so we use the kernel's default
-	   allocator.
-	*/
+	free(line);
+	fclose(smaps);
+	return total;
+}
 
-	void *base = mmap(NULL, si->size, PROT_NONE,
-			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (base == MAP_FAILED) {
-		DL_ERR("%5d mmap of library '%s' failed: %d (%s)\n",
-		       apkenv_pid, si->name,
-		       errno, strerror(errno));
-		goto err;
+/* Big engine libraries spend a lot of time on iTLB misses, so for those
+ * (LOAD_THP_TEXT) we want the text in 2 MiB pages. The reservation was
+ * already aligned to 2 MiB by apkenv_alloc_mem_region(). If the kernel can
+ * put the file's page cache in huge pages (CONFIG_READ_ONLY_THP_FOR_FS),
+ * MADV_COLLAPSE on the file mapping does it synchronously; otherwise the
+ * text is copied into anonymous memory, which can always be huge page
+ * backed (unless THP are disabled altogether). Text without a single 2 MiB
+ * aligned block can't use a huge page either way, so it's left alone.
+ * Returns -1 if the text couldn't be mapped back after all. */
+static int apkenv_thp_text(int fd, soinfo *si, unsigned char *addr, size_t len, ElfW(Phdr) *phdr)
+{
+	int prot = PFLAGS_TO_PROT(phdr->p_flags);
+	off_t offset = phdr->p_offset & ~PAGE_MASK;
+	uintptr_t first_huge = ((uintptr_t)addr + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+	size_t copied = 0;
+
+	if (first_huge + HUGE_PAGE_SIZE > (uintptr_t)addr + len)
+		return 0;
+
+	madvise(addr, len, MADV_HUGEPAGE);
+	if (madvise(addr, len, MADV_COLLAPSE) < 0) {
+		if (mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+			/* a failed MAP_FIXED may have unmapped the text already */
+			DL_ERR("%5d failed to map anonymous memory for the text of '%s': %d (%s)",
+			       apkenv_pid, si->name, errno, strerror(errno));
+			return -1;
+		}
+		madvise(addr, len, MADV_HUGEPAGE);
+
+		while (copied < len) {
+			ssize_t ret = pread(fd, addr + copied, len - copied, offset + copied);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			copied += ret;
+		}
+		if (copied < len) {
+			/* can't leave it half-filled, back to the file mapping */
+			if (mmap(addr, len, prot, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+				DL_ERR("%5d failed to map the text of '%s' back: %d (%s)",
+				       apkenv_pid, si->name, errno, strerror(errno));
+				return -1;
+			}
+			return 0;
+		}
+
+		if (mprotect(addr, len, prot) < 0) {
+			DL_ERR("%5d failed to protect the copied text of '%s': %d (%s)",
+			       apkenv_pid, si->name, errno, strerror(errno));
+			return -1;
+		}
+		madvise(addr, len, MADV_COLLAPSE);
+		apkenv_loader_stats.thp_text_copied_bytes += len;
 	}
-	si->base = (intptr_t)base;
-	PRINT("%5d mapped library '%s' to %016lx via kernel allocator.\n",
-	      apkenv_pid, si->name, si->base);
-	return 0;
 
-err:
-	DL_ERR("OOPS: %5d cannot map library '%s'. no vspace available.",
-	       apkenv_pid, si->name);
-	return -1;
+	size_t huge = apkenv_smaps_huge_bytes((uintptr_t)addr, (uintptr_t)addr + len);
+	apkenv_loader_stats.thp_text_bytes += huge;
+	TRACE("[ %5d text of '%s' @ %p: %zu of %zu bytes in huge pages%s ]\n",
+	      apkenv_pid, si->name, addr, huge, len, copied ? " (copied)" : "");
+	return 0;
 }
 
-#define MAYBE_MAP_FLAG(x, from, to) (((x) & (from)) ? (to) : 0)
-#define PFLAGS_TO_PROT(x)	    (MAYBE_MAP_FLAG((x), PF_X, PROT_EXEC) | \
-			   MAYBE_MAP_FLAG((x), PF_R, PROT_READ) |           \
-			   MAYBE_MAP_FLAG((x), PF_W, PROT_WRITE))
 /* apkenv_load_segments
  *
  *     This function loads all the loadable (PT_LOAD) segments into memory
@@ -1086,6 +2545,8 @@ apkenv_load_segments(int fd, void *header, soinfo *si)
 	unsigned char *extra_base;
 	size_t extra_len;
 	size_t total_sz = 0;
+	unsigned policy = si->load_policy;
+	bool populate;
 
 	si->wrprotect_start = 0xffffffff;
 	si->wrprotect_end = 0;
@@ -1106,8 +2567,9 @@ apkenv_load_segments(int fd, void *header, soinfo *si)
 			      "(0x%016lx). p_vaddr=0x%016lx p_offset=0x%016lx ]\n",
 			      apkenv_pid, si->name,
 			      tmp, len, phdr->p_vaddr, phdr->p_offset);
+			populate = (policy & LOAD_POPULATE) && (phdr->p_flags & PF_X);
 			pbase = mmap((void *)tmp, len, PFLAGS_TO_PROT(phdr->p_flags),
-				     MAP_PRIVATE | MAP_FIXED, fd,
+				     MAP_PRIVATE | MAP_FIXED | (populate ? MAP_POPULATE : 0), fd,
 				     phdr->p_offset & (~PAGE_MASK));
 			if (pbase == MAP_FAILED) {
 				DL_ERR("%d failed to map segment from '%s' @ 0x%016lx (0x%016lx). "
@@ -1117,6 +2579,11 @@ apkenv_load_segments(int fd, void *header, soinfo *si)
 				goto fail;
 			}
 
+			apkenv_apply_load_policy(policy, pbase, len, populate);
+			if ((policy & LOAD_THP_TEXT) && (phdr->p_flags & PF_X) &&
+			    apkenv_thp_text(fd, si, pbase, len, phdr) < 0)
+				goto fail;
+
 			/* If 'len' didn't end on page boundary, and it's a writable
 			 * segment, zero-fill the rest. */
 			if ((len & PAGE_MASK) && (phdr->p_flags & PF_W))
@@ -1174,6 +2641,8 @@ apkenv_load_segments(int fd, void *header, soinfo *si)
 					       extra_len);
 					goto fail;
 				}
+				if ((policy & LOAD_HUGEPAGE) && !madvise(extra_base, extra_len, MADV_HUGEPAGE))
+					apkenv_loader_stats.hugepage_advised_bytes += extra_len;
 				/* TODO: Check if we need to memset-0 this region.
 				 * Anonymous mappings are zero-filled copy-on-writes, so we
 				 * shouldn't need to. */
@@ -1253,7 +2722,7 @@ fail:
 	 * been mapped in from the file before we failed. The kernel will unmap
 	 * all the pages in the range, irrespective of how they got there.
 	 */
-	munmap((void *)si->base, si->size);
+	apkenv_free_mem_region(si);
 	si->flags |= FLAG_ERROR;
 	return -1;
 }
@@ -1326,26 +2795,30 @@ apkenv_load_library(const char *name, const bool try_glibc, int glibc_flag, void
 		return NULL;
 	}
 
-	off_t end;
-	if ((end = lseek(fd, 0, SEEK_END)) < 0) {
-		DL_ERR("lseek() failed!");
+	/* We have to read the ELF header and the program headers to figure out
+	 * what to do with this image, the rest is mapped (and paged in as per
+	 * apkenv_load_policy()) by apkenv_load_segments() */
+	ElfW(Ehdr) ehdr;
+	uint8_t *bytes = NULL;
+	size_t bytes_len;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)) {
+		DL_ERR("read() failed!");
 		goto fail;
 	}
 
-	uint8_t *bytes;
-	if (!(bytes = calloc(1, end))) {
-		DL_ERR("calloc() failed!");
+	bytes_len = MAX(sizeof(ehdr), ehdr.e_phoff + (size_t)ehdr.e_phnum * sizeof(ElfW(Phdr)));
+	if (ehdr.e_phoff > 0x100000) {
+		DL_ERR("%5d '%s' has an invalid e_phoff", apkenv_pid, name);
 		goto fail;
 	}
 
-	/* We have to read the ELF header to figure out what to do with this image
-	 */
-	if (lseek(fd, 0, SEEK_SET) < 0) {
-		DL_ERR("lseek() failed!");
+	if (!(bytes = calloc(1, bytes_len))) {
+		DL_ERR("calloc() failed!");
 		goto fail;
 	}
 
-	if ((cnt = read(fd, bytes, end)) < 0) {
+	if ((cnt = pread(fd, bytes, bytes_len, 0)) < 0) {
 		DL_ERR("read() failed!");
 		goto fail;
 	}
@@ -1376,6 +2849,7 @@ apkenv_load_library(const char *name, const bool try_glibc, int glibc_flag, void
 	 * segments */
 	si->base = req_base;
 	si->size = ext_sz;
+	si->load_policy = apkenv_load_policy(si->name);
 	si->flags = 0;
 	si->entry = 0;
 	si->dynamic = (ElfW(Dyn) *)-1;
@@ -1396,13 +2870,18 @@ apkenv_load_library(const char *name, const bool try_glibc, int glibc_flag, void
 	si->phdr = (ElfW(Phdr) *)((unsigned char *)si->base + hdr->e_phoff);
 	si->phnum = hdr->e_phnum;
 	/**/
+	apkenv_dl_adds++;
+
+	apkenv_pgprof_load(fd, si);
 
+	free(bytes);
 	close(fd);
 	return si;
 
 fail:
 	if (si)
 		apkenv_free_info(si);
+	free(bytes);
 	close(fd);
 	return NULL;
 }
@@ -1420,7 +2899,9 @@ apkenv_init_library(soinfo *si)
 		/* We failed to link.  However, we can only restore libbase
 		** if no additional libraries have moved it since we updated it.
 		*/
-		munmap((void *)si->base, si->size);
+		apkenv_pgprof_unload(si);
+		apkenv_free_mem_region(si);
+		apkenv_dl_subs++;
 		return NULL;
 	}
 
@@ -1451,12 +2932,9 @@ soinfo *apkenv_find_library(const char *name, const bool try_glibc, int glibc_fl
 	else if(!strncmp(name, prefix64, prefix64_len))
 		name += prefix64_len;
 
-	for(int i = 0; i < lib_override_map_len; i++) {
-		if(!strcmp(lib_override_map[i].from, name)) {
-			name = lib_override_map[i].to;
-			break;
-		}
-	}
+	const char *override = lib_override_lookup(name);
+	if (override)
+		name = override;
 
 	bname = strrchr(name, '/');
 	bname = bname ? bname + 1 : name;
@@ -1494,43 +2972,36 @@ soinfo *apkenv_find_library(const char *name, const bool try_glibc, int glibc_fl
 static void apkenv_call_destructors(soinfo *si);
 unsigned int apkenv_unload_library(soinfo *si)
 {
+	if (si == &apkenv_libdl_info) {
+		/* also stands in for every DT_NEEDED library that glibc loaded
+		 * for us (see apkenv_link_image), it's static and never unloaded */
+		if (si->refcount > 0)
+			si->refcount--;
+		return si->refcount;
+	}
+
 	if (si->refcount == 1) {
 		TRACE("%5d unloading '%s'\n", apkenv_pid, si->name);
 		apkenv_call_destructors(si);
 
-		/*
-		 * Make sure that we undo the PT_GNU_RELRO protections we added
-		 * in apkenv_link_image. This is needed to undo the DT_NEEDED hack below.
-		 */
-		if ((si->gnu_relro_start != 0) && (si->gnu_relro_len != 0)) {
-			ElfW(Addr) start = (si->gnu_relro_start & ~PAGE_MASK);
-			size_t len = (si->gnu_relro_start - start) + si->gnu_relro_len;
-			if (mprotect((void *)start, len, PROT_READ | PROT_WRITE) < 0)
-				DL_ERR("%5d %s: could not undo GNU_RELRO protections. "
-				       "Expect a crash soon. errno=%d (%s)",
-				       apkenv_pid, si->name, errno, strerror(errno));
-		}
-
-		for (ElfW(Dyn) *d = si->dynamic; d->d_tag != DT_NULL; d++) {
-			if (d->d_tag == DT_NEEDED) {
-				soinfo *lsi = (soinfo *)d->d_un.d_val;
-
-				// The next line will segfault if the we don't undo the
-				// PT_GNU_RELRO protections (see comments above and in
-				// apkenv_link_image().
-				d->d_un.d_val = 0;
-
-				if (apkenv_validate_soinfo(lsi)) {
-					TRACE("%5d %s needs to unload %s\n", apkenv_pid,
-					      si->name, lsi->name);
-					apkenv_unload_library(lsi);
-				} else
-					DL_ERR("%5d %s: could not unload dependent library",
-					       apkenv_pid, si->name);
-			}
+		for (size_t i = 0; i < si->needed_count; i++) {
+			soinfo *lsi = si->needed[i];
+			TRACE("%5d %s needs to unload %s\n", apkenv_pid,
+			      si->name, lsi->name);
+			apkenv_unload_library(lsi);
 		}
-
-		munmap((char *)si->base, si->size);
+		/* lookup_scope shares the allocation */
+		free(si->needed);
+		si->needed = NULL;
+		si->needed_count = 0;
+		si->lookup_scope = NULL;
+		si->lookup_scope_count = 0;
+
+#if !defined(__arm__)
+		apkenv_deregister_eh_frame(si);
+#endif
+		apkenv_pgprof_unload(si);
+		apkenv_free_mem_region(si);
 		apkenv_notify_gdb_of_unload(si);
 		apkenv_free_info(si);
 		si->refcount = 0;
@@ -1756,6 +3227,8 @@ static ElfW(Addr) prepare_stub_func(const char* sym_name) {
 }
 
 #if defined(USE_RELA)
+static bool apkenv_load_deferred_needed(soinfo *si, const char *sym_name, ElfW(Sym) **s, ElfW(Addr) *base, ElfW(Addr) *sym_addr);
+
 static int apkenv_reloc_library(soinfo *si, ElfW(Rela) * rela, size_t count)
 {
 	ElfW(Sym) * s;
@@ -1791,11 +3264,9 @@ static int apkenv_reloc_library(soinfo *si, ElfW(Rela) * rela, size_t count)
 				if (strstr(sym_name, "pthread_"))
 					fprintf(stderr, "symbol may need to be wrapped: %s\n", sym_name);
 				LINKER_DEBUG_PRINTF("%s hooked symbol %s to %016lx\n", si->name, sym_name, sym_addr);
-			} else if (!sym_addr && !strncmp(sym_name, "gl", 2)) {
-				LINKER_DEBUG_PRINTF("=======================================\n");
-				LINKER_DEBUG_PRINTF("%s symbol %s is an OpenGL extension?\n", si->name, sym_name);
-				if ((sym_addr = (intptr_t)eglGetProcAddress(sym_name)))
-					LINKER_DEBUG_PRINTF("%s hooked symbol %s to %016lx\n", si->name, sym_name, sym_addr);
+			} else if (!strncmp(sym_name, "gl", 2) && (sym_addr = (intptr_t)eglGetProcAddress(sym_name))) {
+				// an OpenGL extension
+				LINKER_DEBUG_PRINTF("%s hooked symbol %s to %016lx\n", si->name, sym_name, sym_addr);
 			} else if (!strcmp(sym_name, "sigsetjmp")) {
 				// we can't wrap this, so we need to substitute it for the correct function here
 				// __sigsetjmp is the glibc version, but the musl version is just sigsetjmp so it should be resolved properly by dslsym
@@ -1806,6 +3277,10 @@ static int apkenv_reloc_library(soinfo *si, ElfW(Rela) * rela, size_t count)
 				fprintf(stderr, "sigsetjmp special handling shouldn't be needed on musl\n");
 				exit(1);
 #endif
+			} else if (ELF_ST_BIND(si->symtab[sym].st_info) != STB_WEAK &&
+				   apkenv_load_deferred_needed(si, sym_name, &s, &base, &sym_addr)) {
+				// provided by a deferred DT_NEEDED library, only looked for
+				// when nothing else has it
 			} else {
 				// symbol not found
 				if (getenv("LINKER_DIE_AT_RUNTIME")) {
@@ -2105,6 +3580,9 @@ static int apkenv_reloc_library(soinfo *si, ElfW(Rel) * rel, size_t count)
 				if (strstr(sym_name, "pthread_"))
 					fprintf(stderr, "symbol may need to be wrapped: %s\n", sym_name);
 				LINKER_DEBUG_PRINTF("%s hooked symbol %s to %x\n", si->name, sym_name, sym_addr);
+			} else if (ELF_ST_BIND(si->symtab[sym].st_info) != STB_WEAK &&
+				   apkenv_load_deferred_needed(si, sym_name, &s, &base, &sym_addr)) {
+				// provided by a deferred DT_NEEDED library
 			} else {
 				// symbol not found
 				if(getenv("LINKER_DIE_AT_RUNTIME")) {
@@ -2396,19 +3874,8 @@ void apkenv_call_constructors_recursive(soinfo *si)
 	apkenv_call_array(si->preinit_array, si->preinit_array_count, 0);
 	TRACE("[ %5d Done calling preinit_array for '%s' ]\n", apkenv_pid, si->name);
 
-	if (si->dynamic) {
-		for (ElfW(Dyn) *d = si->dynamic; d->d_tag != DT_NULL; d++) {
-			if (d->d_tag == DT_NEEDED) {
-				soinfo *lsi = (soinfo *)d->d_un.d_val;
-				if (!apkenv_validate_soinfo(lsi)) {
-					DL_ERR("%5d bad DT_NEEDED pointer in %s",
-					       apkenv_pid, si->name);
-				} else {
-					apkenv_call_constructors_recursive(lsi);
-				}
-			}
-		}
-	}
+	for (size_t i = 0; i < si->needed_count; i++)
+		apkenv_call_constructors_recursive(si->needed[i]);
 
 	if (si->init_func) {
 		TRACE("[ %5d Calling init_func @ 0x%016lx for '%s' ]\n", apkenv_pid,
@@ -2591,8 +4058,97 @@ static void apkenv_create_latehook_wrappers(soinfo *si)
 	}
 }
 
+static void apkenv_scope_append(soinfo *si, soinfo *lsi)
+{
+	struct soinfo_lookup *l = apkenv_soinfo_lookup(lsi);
+
+	for (size_t i = 0; i < si->lookup_scope_count; i++) {
+		if (si->lookup_scope[i] == l)
+			return;
+	}
+	si->lookup_scope[si->lookup_scope_count++] = l;
+}
+
+/* Lazy DT_NEEDED: libraries matching BIONIC_LD_LAZY (or `@lazy <pattern>...`
+ * in cfg.d), unless they also match BIONIC_LD_EAGER (`@eager`), are not loaded
+ * while linking the library that needs them. Only when a relocation can't be
+ * resolved by anything loaded so far (including the host libraries), they
+ * are loaded in DT_NEEDED order until one of them provides the symbol (weak
+ * references don't count, they are just left unresolved). Since
+ * all relocations are resolved at link time, the ones that are still
+ * deferred after that are never loaded at all. Note that this means that
+ * such libraries lose against the host libraries for symbols defined in both,
+ * so anything that interposes host symbols or needs its constructors run
+ * early must not be deferred. */
+static bool apkenv_needed_is_lazy(const char *name)
+{
+	const char *bname = strrchr(name, '/');
+	bname = bname ? bname + 1 : name;
+
+	return apkenv_load_policy_matches("BIONIC_LD_LAZY", "lazy", "", bname) &&
+	       !apkenv_load_policy_matches("BIONIC_LD_EAGER", "eager", "", bname);
+}
+
+static bool apkenv_load_deferred_needed(soinfo *si, const char *sym_name, ElfW(Sym) **s, ElfW(Addr) *base, ElfW(Addr) *sym_addr)
+{
+	while (si->deferred_needed_count) {
+		const char *name = si->deferred_needed[0];
+		si->deferred_needed_count--;
+		memmove(si->deferred_needed, si->deferred_needed + 1, si->deferred_needed_count * sizeof(si->deferred_needed[0]));
+
+		TRACE("[ %5d %s: loading deferred %s for %s ]\n", apkenv_pid, si->name, name, sym_name);
+		soinfo *lsi = apkenv_find_library(name, true, RTLD_NOW, NULL);
+		if (lsi)
+			apkenv_loader_stats.deferred_needed_loaded++;
+		else
+			lsi = &apkenv_libdl_info; /* same as in apkenv_link_image() */
+		si->needed[si->needed_count++] = lsi;
+		lsi->refcount++;
+		apkenv_scope_append(si, lsi);
+
+		struct soinfo_lookup *l = apkenv_soinfo_lookup(lsi);
+		if ((*s = apkenv__elf_lookup(l, &(struct symbol_name){ .name = sym_name }))) {
+			*base = l->base;
+			return true;
+		}
+		/* a library loaded with the glibc fallback is RTLD_GLOBAL */
+		if ((*sym_addr = (intptr_t)dlsym(RTLD_DEFAULT, sym_name)))
+			return true;
+	}
+
+	return false;
+}
+
+/* Put together the list of libraries which relocations in `si` are resolved
+ * against, so that apkenv__do_lookup() only has to walk a flat array.
+ *
+ * We look in the local scope (the object who is searching) first. This
+ * happens with C++ templates on i386 for some reason. Next come the
+ * apkenv_preloads, then the DT_NEEDED libraries in order.
+ *
+ * If we are resolving relocations while dlopen()ing a library, it's OK for
+ * the library to resolve a symbol that's defined in the executable itself,
+ * although this is rare and is generally a bad idea.
+ */
+static void apkenv_build_lookup_scope(soinfo *si)
+{
+	si->lookup_scope_count = 0;
+
+	apkenv_scope_append(si, si);
+	for (int i = 0; apkenv_preloads[i] != NULL; i++)
+		apkenv_scope_append(si, apkenv_preloads[i]);
+	for (size_t i = 0; i < si->needed_count; i++)
+		apkenv_scope_append(si, si->needed[i]);
+#if ALLOW_SYMBOLS_FROM_MAIN
+	if (apkenv_somain)
+		apkenv_scope_append(si, apkenv_somain);
+#endif
+}
+
 static int apkenv_link_image(soinfo *si, /*unused...?*/ unsigned wr_offset)
 {
+	size_t needed_count = 0;
+
 	ElfW(Phdr) *phdr = si->phdr;
 	int phnum = si->phnum;
 
@@ -2837,6 +4393,11 @@ static int apkenv_link_image(soinfo *si, /*unused...?*/ unsigned wr_offset)
 			 */
 			DEBUG("%5d Text segment should be writable during relocation.\n",
 			      apkenv_pid);
+			si->flags |= FLAG_TEXTREL;
+			break;
+		case DT_FLAGS:
+			if (d->d_un.d_val & DF_TEXTREL)
+				si->flags |= FLAG_TEXTREL;
 			break;
 		}
 	}
@@ -2870,9 +4431,31 @@ static int apkenv_link_image(soinfo *si, /*unused...?*/ unsigned wr_offset)
 		}
 	}
 
+	for (ElfW(Dyn) *d = si->dynamic; d->d_tag != DT_NULL; d++) {
+		if (d->d_tag == DT_NEEDED)
+			needed_count++;
+	}
+
+	/* one allocation for si->needed and si->lookup_scope: the scope holds
+	 * at most the library itself, the preloads, the needed ones and main */
+	si->needed = calloc(needed_count + (1 + LDPRELOAD_MAX + needed_count + 1), sizeof(soinfo *));
+	if (!si->needed) {
+		DL_ERR("%5d calloc() failed!", apkenv_pid);
+		goto fail;
+	}
+	si->lookup_scope = (struct soinfo_lookup **)(si->needed + needed_count);
+
 	for (ElfW(Dyn) *d = si->dynamic; d->d_tag != DT_NULL; d++) {
 		if (d->d_tag == DT_NEEDED) {
 			DEBUG("%5d %s needs %s\n", apkenv_pid, si->name, si->strtab + d->d_un.d_val);
+			if (!(si->flags & FLAG_EXE) && apkenv_needed_is_lazy(si->strtab + d->d_un.d_val)) {
+				if (!si->deferred_needed && !(si->deferred_needed = calloc(needed_count, sizeof(char *)))) {
+					DL_ERR("%5d calloc() failed!", apkenv_pid);
+					goto fail;
+				}
+				si->deferred_needed[si->deferred_needed_count++] = si->strtab + d->d_un.d_val;
+				continue;
+			}
 			soinfo *lsi = NULL;
 			// if (get_builtin_lib_handle(si->strtab + d->d_un.d_val) == NULL)
 			lsi = apkenv_find_library(si->strtab + d->d_un.d_val, true, RTLD_NOW, NULL);
@@ -2891,18 +4474,13 @@ static int apkenv_link_image(soinfo *si, /*unused...?*/ unsigned wr_offset)
 				// continue;
 				// goto fail;
 			}
-			/* Save the soinfo of the loaded DT_NEEDED library in the payload
-			   of the DT_NEEDED entry itself, so that we can retrieve the
-			   soinfo directly later from the dynamic segment.  This is a hack,
-			   but it allows us to map from DT_NEEDED to soinfo efficiently
-			   later on when we resolve relocations, trying to look up a symbol
-			   with dlsym().
-			*/
-			d->d_un.d_val = (intptr_t)lsi;
+			si->needed[si->needed_count++] = lsi;
 			lsi->refcount++;
 		}
 	}
 
+	apkenv_build_lookup_scope(si);
+
 #if defined(USE_RELA)
 	if (si->plt_rela != NULL) {
 		DEBUG("[ %5d relocating %s plt ]\n", apkenv_pid, si->name);
@@ -2934,6 +4512,11 @@ static int apkenv_link_image(soinfo *si, /*unused...?*/ unsigned wr_offset)
 			goto fail;
 	}
 
+	apkenv_loader_stats.deferred_needed_skipped += si->deferred_needed_count;
+	free(si->deferred_needed);
+	si->deferred_needed = NULL;
+	si->deferred_needed_count = 0;
+
 	apkenv_create_latehook_wrappers(si);
 
 	si->flags |= FLAG_LINKED;
@@ -2975,6 +4558,9 @@ static int apkenv_link_image(soinfo *si, /*unused...?*/ unsigned wr_offset)
 		}
 	}
 
+	apkenv_trim_relocations(si);
+	apkenv_merge_segments(si);
+
 	/* If this is a SET?ID program, dup /dev/null to opened stdin,
 	   stdout and stderr to close a security hole described in:
 
@@ -2983,11 +4569,34 @@ static int apkenv_link_image(soinfo *si, /*unused...?*/ unsigned wr_offset)
 	 */
 	if (apkenv_program_is_setuid)
 		apkenv_nullify_closed_stdio();
+#if !defined(__arm__)
+	if (!(si->flags & (FLAG_EXE | FLAG_LINKER)))
+		apkenv_register_eh_frame(si);
+#endif
 	apkenv_notify_gdb_of_load(si);
 	return 0;
 
 fail:
 	ERROR("failed to link %s\n", si->name);
+	/* drop the references taken above, so the dependencies aren't kept
+	 * loaded forever on behalf of a library that never was */
+	for (size_t i = 0; i < si->needed_count; i++)
+		apkenv_unload_library(si->needed[i]);
+	/* lookup_scope shares the allocation */
+	free(si->needed);
+	si->needed = NULL;
+	si->needed_count = 0;
+	si->lookup_scope = NULL;
+	si->lookup_scope_count = 0;
+	if (si->flags & FLAG_EXE) {
+		for (int i = 0; i < LDPRELOAD_MAX && apkenv_preloads[i]; i++) {
+			apkenv_unload_library(apkenv_preloads[i]);
+			apkenv_preloads[i] = NULL;
+		}
+	}
+	free(si->deferred_needed);
+	si->deferred_needed = NULL;
+	si->deferred_needed_count = 0;
 	si->flags |= FLAG_ERROR;
 	return -1;
 }
@@ -3013,4 +4622,11 @@ void dl_parse_library_path(const char *path, char *delim)
 	} else {
 		apkenv_ldpaths[i] = NULL;
 	}
+
+	for (i = 0; i < LDPATH_MAX; i++) {
+		if (apkenv_ldpaths[i])
+			apkenv_search_dir_init(&apkenv_ldpath_dirs[i], apkenv_ldpaths[i]);
+		else
+			apkenv_search_dir_clear(&apkenv_ldpath_dirs[i]);
+	}
 }
@@ -110,12 +110,50 @@ struct r_debug
 #define DT_ANDROID_RELRCOUNT 0x6fffe005
 
 typedef struct soinfo soinfo;
+struct apkenv_sysv_index;
+
+struct apkenv_sysv_index_entry {
+	uint32_t hash;
+	uint32_t symidx;
+};
+
+enum {
+	SOINFO_LOOKUP_UNSET = 0,
+	SOINFO_LOOKUP_SYSV,
+	SOINFO_LOOKUP_GNU,
+	SOINFO_LOOKUP_SYSV_INDEX, // DT_HASH, looked up through soinfo->sysv_index
+};
+
+/* The few fields of a soinfo that symbol lookup reads, packed into a single
+ * cache line. These live in an array of their own next to the soinfo pool,
+ * so walking a lookup scope touches one line per library instead of the
+ * several that the same fields are spread over in struct soinfo (whose
+ * layout stays as it is for the benefit of debuggers). */
+struct soinfo_lookup {
+	const char *strtab;
+	ElfW(Sym) *symtab;
+	uint32_t *bucket;
+	union {
+		uint32_t *chain;
+		struct apkenv_sysv_index_entry *entries; // SOINFO_LOOKUP_SYSV_INDEX
+	};
+	ElfW(Addr) *bloom_filter;
+	ElfW(Addr) base;
+
+	uint32_t nbucket; // bucket mask for SOINFO_LOOKUP_SYSV_INDEX
+	uint32_t maskwords;
+	uint32_t shift2;
+	uint32_t kind;
+} __attribute__((aligned(64)));
 
 #define FLAG_LINKED	0x00000001
 #define FLAG_ERROR	0x00000002
 #define FLAG_EXE	0x00000004 // The main executable
 #define FLAG_LINKER	0x00000010 // The linker itself
 #define FLAG_GNU_HASH   0x00000040 // uses gnu hash
+#define FLAG_TEXTREL    0x00000080 // has relocations in read-only segments
+#define FLAG_DLSYM      0x00000100 // used as a handle for dlsym()
+#define FLAG_HASH_TRIMMED 0x00000200 // hash table pages dropped after loading
 
 #define SOINFO_NAME_LEN 128
 
@@ -208,6 +246,35 @@ struct soinfo {
 
 	/* apkenv stuff */
 	char fullpath[SOINFO_NAME_LEN];
+
+	/* LOAD_* flags, see apkenv_load_policy() */
+	unsigned load_policy;
+
+#if !defined(__arm__)
+	/* .eh_frame registered with the host unwinder, and the storage it
+	 * needs for its bookkeeping (libgcc's `struct object`) */
+	const void *eh_frame;
+	uintptr_t eh_frame_object[8];
+#endif
+
+	/* DT_NEEDED libraries in order (libdl's soinfo for any we couldn't load) */
+	soinfo **needed;
+	size_t needed_count;
+
+	/* everything a relocation in this library may resolve to, in search
+	 * order: the library itself, the preloads, DT_NEEDED, the executable */
+	struct soinfo_lookup **lookup_scope;
+	size_t lookup_scope_count;
+
+	/* DT_NEEDED libraries not loaded yet (BIONIC_LD_LAZY), only while
+	 * linking: they are loaded when a relocation can't be resolved
+	 * otherwise */
+	const char **deferred_needed;
+	size_t deferred_needed_count;
+
+	/* GNU-style bloom filter + hash table over the defined globals of a
+	 * DT_HASH-only library, built on its first lookup */
+	struct apkenv_sysv_index *sysv_index;
 };
 
 extern soinfo apkenv_libdl_info;
@@ -236,6 +303,10 @@ extern soinfo apkenv_libdl_info;
 #define DT_PREINIT_ARRAYSZ 33
 #endif
 
+struct dl_loader_stats;
+void apkenv_trim_hash_tables(soinfo *except);
+void apkenv_get_loader_stats(struct dl_loader_stats *stats);
+
 soinfo *apkenv_find_library(const char *name, const bool try_glibc, int glibc_flags, void **glibc_handle);
 unsigned apkenv_unload_library(soinfo *si);
 ElfW(Sym) *apkenv_lookup_in_library(soinfo *si, const char *name);
@@ -0,0 +1,548 @@
+/* Microbenchmarks for libpthread_bio, next to the host primitives it's built
+ * on, so that what the shim adds to their hot paths can be told apart from
+ * what they cost anyway.
+ *
+ * Every benchmark runs for a while (-m, in milliseconds) with each of the
+ * thread counts given with -t (1,2,4,8 by default), first with the bionic_*
+ * functions and then with the host ones, and prints a line per run:
+ *   <benchmark>	<impl>	<threads>	<ops>	<seconds>	<ns_per_op>
+ * where ns_per_op is the wall time per operation of each thread; lines
+ * starting with '#' are comments. The benchmarks to run can be given as
+ * arguments, all of them are run otherwise. */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+#define MAX_THREADS 256
+
+/* big enough for either implementation's objects, and on a cache line of its
+ * own */
+union object {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_rwlock_t rwlock;
+	sem_t sem;
+	int32_t bionic[16];
+} __attribute__((aligned(64)));
+
+/* bionic's types are opaque here, so their functions are declared on the
+ * storage above; bionic_pthread_t is a long (see libpthread.c) */
+int bionic_pthread_mutex_init(union object *mutex, const void *attr);
+int bionic_pthread_mutex_lock(union object *mutex);
+int bionic_pthread_mutex_unlock(union object *mutex);
+int bionic_pthread_mutex_destroy(union object *mutex);
+int bionic_pthread_cond_init(union object *cond, const void *attr);
+int bionic_pthread_cond_wait(union object *cond, union object *mutex);
+int bionic_pthread_cond_signal(union object *cond);
+int bionic_pthread_cond_broadcast(union object *cond);
+int bionic_pthread_cond_destroy(union object *cond);
+int bionic_pthread_rwlock_init(union object *rwlock, const void *attr);
+int bionic_pthread_rwlock_rdlock(union object *rwlock);
+int bionic_pthread_rwlock_unlock(union object *rwlock);
+int bionic_pthread_rwlock_destroy(union object *rwlock);
+int bionic_sem_init(union object *sem, int pshared, unsigned int value);
+int bionic_sem_post(union object *sem);
+int bionic_sem_wait(union object *sem);
+int bionic_sem_destroy(union object *sem);
+int bionic_pthread_create(long *thread, const void *attr, void *(*start)(void *), void *arg);
+int bionic_pthread_join(long thread, void **retval);
+void bionic___pthread_cleanup_push(void *c, void (*routine)(void *), void *arg);
+void bionic___pthread_cleanup_pop(void *c, int execute);
+
+struct impl {
+	const char *name;
+	int (*mutex_init)(union object *mutex);
+	// what PTHREAD_MUTEX_INITIALIZER does, and likewise for the cond
+	void (*mutex_static_init)(union object *mutex);
+	int (*mutex_lock)(union object *mutex);
+	int (*mutex_unlock)(union object *mutex);
+	int (*mutex_destroy)(union object *mutex);
+	int (*cond_init)(union object *cond);
+	void (*cond_static_init)(union object *cond);
+	int (*cond_wait)(union object *cond, union object *mutex);
+	int (*cond_signal)(union object *cond);
+	int (*cond_broadcast)(union object *cond);
+	int (*cond_destroy)(union object *cond);
+	int (*rwlock_init)(union object *rwlock);
+	int (*rwlock_rdlock)(union object *rwlock);
+	int (*rwlock_unlock)(union object *rwlock);
+	int (*rwlock_destroy)(union object *rwlock);
+	int (*sem_init)(union object *sem);
+	int (*sem_post)(union object *sem);
+	int (*sem_wait)(union object *sem);
+	int (*sem_destroy)(union object *sem);
+	int (*create_join)(void *(*start)(void *));
+	void (*cleanup_push_pop)(void (*routine)(void *));
+};
+
+static int bionic_mutex_init(union object *mutex) { return bionic_pthread_mutex_init(mutex, NULL); }
+// bionic's initializers for a normal mutex and a cond are all zeroes
+static void bionic_mutex_static_init(union object *mutex) { memset(mutex, 0, sizeof(*mutex)); }
+static int bionic_cond_init(union object *cond) { return bionic_pthread_cond_init(cond, NULL); }
+static void bionic_cond_static_init(union object *cond) { memset(cond, 0, sizeof(*cond)); }
+static int bionic_rwlock_init(union object *rwlock) { return bionic_pthread_rwlock_init(rwlock, NULL); }
+static int bionic_sem_init0(union object *sem) { return bionic_sem_init(sem, 0, 0); }
+
+static int bionic_create_join(void *(*start)(void *))
+{
+	long thread;
+	int ret = bionic_pthread_create(&thread, NULL, start, NULL);
+	return ret ? ret : bionic_pthread_join(thread, NULL);
+}
+
+static void bionic_cleanup_push_pop(void (*routine)(void *))
+{
+	void *c[3]; // struct bionic_pthread_cleanup_t
+	bionic___pthread_cleanup_push(c, routine, NULL);
+	bionic___pthread_cleanup_pop(c, 0);
+}
+
+static const struct impl bionic = {
+	.name = "bionic",
+	.mutex_init = bionic_mutex_init,
+	.mutex_static_init = bionic_mutex_static_init,
+	.mutex_lock = bionic_pthread_mutex_lock,
+	.mutex_unlock = bionic_pthread_mutex_unlock,
+	.mutex_destroy = bionic_pthread_mutex_destroy,
+	.cond_init = bionic_cond_init,
+	.cond_static_init = bionic_cond_static_init,
+	.cond_wait = bionic_pthread_cond_wait,
+	.cond_signal = bionic_pthread_cond_signal,
+	.cond_broadcast = bionic_pthread_cond_broadcast,
+	.cond_destroy = bionic_pthread_cond_destroy,
+	.rwlock_init = bionic_rwlock_init,
+	.rwlock_rdlock = bionic_pthread_rwlock_rdlock,
+	.rwlock_unlock = bionic_pthread_rwlock_unlock,
+	.rwlock_destroy = bionic_pthread_rwlock_destroy,
+	.sem_init = bionic_sem_init0,
+	.sem_post = bionic_sem_post,
+	.sem_wait = bionic_sem_wait,
+	.sem_destroy = bionic_sem_destroy,
+	.create_join = bionic_create_join,
+	.cleanup_push_pop = bionic_cleanup_push_pop,
+};
+
+static int host_mutex_init(union object *mutex) { return pthread_mutex_init(&mutex->mutex, NULL); }
+static void host_mutex_static_init(union object *mutex) { mutex->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER; }
+static int host_mutex_lock(union object *mutex) { return pthread_mutex_lock(&mutex->mutex); }
+static int host_mutex_unlock(union object *mutex) { return pthread_mutex_unlock(&mutex->mutex); }
+static int host_mutex_destroy(union object *mutex) { return pthread_mutex_destroy(&mutex->mutex); }
+static int host_cond_init(union object *cond) { return pthread_cond_init(&cond->cond, NULL); }
+static void host_cond_static_init(union object *cond) { cond->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER; }
+static int host_cond_wait(union object *cond, union object *mutex) { return pthread_cond_wait(&cond->cond, &mutex->mutex); }
+static int host_cond_signal(union object *cond) { return pthread_cond_signal(&cond->cond); }
+static int host_cond_broadcast(union object *cond) { return pthread_cond_broadcast(&cond->cond); }
+static int host_cond_destroy(union object *cond) { return pthread_cond_destroy(&cond->cond); }
+static int host_rwlock_init(union object *rwlock) { return pthread_rwlock_init(&rwlock->rwlock, NULL); }
+static int host_rwlock_rdlock(union object *rwlock) { return pthread_rwlock_rdlock(&rwlock->rwlock); }
+static int host_rwlock_unlock(union object *rwlock) { return pthread_rwlock_unlock(&rwlock->rwlock); }
+static int host_rwlock_destroy(union object *rwlock) { return pthread_rwlock_destroy(&rwlock->rwlock); }
+static int host_sem_init(union object *sem) { return sem_init(&sem->sem, 0, 0); }
+static int host_sem_post(union object *sem) { return sem_post(&sem->sem); }
+static int host_sem_wait(union object *sem) { return sem_wait(&sem->sem); }
+static int host_sem_destroy(union object *sem) { return sem_destroy(&sem->sem); }
+
+static int host_create_join(void *(*start)(void *))
+{
+	pthread_t thread;
+	int ret = pthread_create(&thread, NULL, start, NULL);
+	return ret ? ret : pthread_join(thread, NULL);
+}
+
+static void host_cleanup_push_pop(void (*routine)(void *))
+{
+	pthread_cleanup_push(routine, NULL);
+	pthread_cleanup_pop(0);
+}
+
+static const struct impl host = {
+	.name = "host",
+	.mutex_init = host_mutex_init,
+	.mutex_static_init = host_mutex_static_init,
+	.mutex_lock = host_mutex_lock,
+	.mutex_unlock = host_mutex_unlock,
+	.mutex_destroy = host_mutex_destroy,
+	.cond_init = host_cond_init,
+	.cond_static_init = host_cond_static_init,
+	.cond_wait = host_cond_wait,
+	.cond_signal = host_cond_signal,
+	.cond_broadcast = host_cond_broadcast,
+	.cond_destroy = host_cond_destroy,
+	.rwlock_init = host_rwlock_init,
+	.rwlock_rdlock = host_rwlock_rdlock,
+	.rwlock_unlock = host_rwlock_unlock,
+	.rwlock_destroy = host_rwlock_destroy,
+	.sem_init = host_sem_init,
+	.sem_post = host_sem_post,
+	.sem_wait = host_sem_wait,
+	.sem_destroy = host_sem_destroy,
+	.create_join = host_create_join,
+	.cleanup_push_pop = host_cleanup_push_pop,
+};
+
+/* a run of one benchmark with one implementation and thread count */
+struct run {
+	const struct impl *impl;
+	unsigned threads;
+	bool stop;
+	pthread_barrier_t start;
+	union object mutex, cond, rwlock, sem;
+	// the thread whose turn it is, for the ping-pong
+	unsigned turn;
+	// one per thread, for the uncontended mutex
+	union object *own;
+};
+
+struct worker {
+	struct run *run;
+	unsigned index;
+	unsigned long long ops;
+	pthread_t thread;
+};
+
+static inline bool stopped(struct run *run)
+{
+	return __atomic_load_n(&run->stop, __ATOMIC_RELAXED);
+}
+
+static void nop(void *arg)
+{
+}
+
+static void *empty_thread(void *arg)
+{
+	return NULL;
+}
+
+static void mutex_setup(struct run *run)
+{
+	run->impl->mutex_init(&run->mutex);
+	run->own = calloc(run->threads, sizeof(*run->own));
+	for (unsigned i = 0; i < run->threads; i++)
+		run->impl->mutex_init(&run->own[i]);
+}
+
+// the same with static initializers, which the shim only sets up on first use
+static void mutex_static_setup(struct run *run)
+{
+	run->impl->mutex_static_init(&run->mutex);
+	run->own = calloc(run->threads, sizeof(*run->own));
+	for (unsigned i = 0; i < run->threads; i++)
+		run->impl->mutex_static_init(&run->own[i]);
+}
+
+static void mutex_teardown(struct run *run)
+{
+	for (unsigned i = 0; i < run->threads; i++)
+		run->impl->mutex_destroy(&run->own[i]);
+	free(run->own);
+	run->impl->mutex_destroy(&run->mutex);
+}
+
+// a mutex of each thread's own: the cost of the fast path
+static void mutex_uncontended(struct worker *w)
+{
+	const struct impl *impl = w->run->impl;
+	union object *mutex = &w->run->own[w->index];
+
+	while (!stopped(w->run)) {
+		impl->mutex_lock(mutex);
+		impl->mutex_unlock(mutex);
+		w->ops++;
+	}
+}
+
+static void mutex_contended(struct worker *w)
+{
+	const struct impl *impl = w->run->impl;
+
+	while (!stopped(w->run)) {
+		impl->mutex_lock(&w->run->mutex);
+		impl->mutex_unlock(&w->run->mutex);
+		w->ops++;
+	}
+}
+
+// the first use of a statically initialized mutex: an operation is one
+// lock/unlock of a fresh one, which is destroyed again
+static void mutex_static_first_use(struct worker *w)
+{
+	const struct impl *impl = w->run->impl;
+	union object *mutex = &w->run->own[w->index];
+
+	while (!stopped(w->run)) {
+		impl->mutex_static_init(mutex);
+		impl->mutex_lock(mutex);
+		impl->mutex_unlock(mutex);
+		impl->mutex_destroy(mutex);
+		w->ops++;
+	}
+	impl->mutex_static_init(mutex);
+}
+
+static void cond_setup(struct run *run)
+{
+	run->impl->mutex_init(&run->mutex);
+	run->impl->cond_init(&run->cond);
+	run->turn = 0;
+}
+
+static void cond_static_setup(struct run *run)
+{
+	run->impl->mutex_static_init(&run->mutex);
+	run->impl->cond_static_init(&run->cond);
+	run->turn = 0;
+}
+
+static void cond_stop(struct run *run)
+{
+	run->impl->mutex_lock(&run->mutex);
+	run->impl->cond_broadcast(&run->cond);
+	run->impl->mutex_unlock(&run->mutex);
+}
+
+static void cond_teardown(struct run *run)
+{
+	run->impl->cond_destroy(&run->cond);
+	run->impl->mutex_destroy(&run->mutex);
+}
+
+// the threads take turns, each waking up the next one: an operation is one
+// handoff
+static void cond_pingpong(struct worker *w)
+{
+	struct run *run = w->run;
+	const struct impl *impl = run->impl;
+
+	impl->mutex_lock(&run->mutex);
+	while (!stopped(run)) {
+		while (run->turn != w->index && !stopped(run))
+			impl->cond_wait(&run->cond, &run->mutex);
+		run->turn = (w->index + 1) % run->threads;
+		// with more than two threads, the next one has to be among those
+		// woken up
+		if (run->threads > 2)
+			impl->cond_broadcast(&run->cond);
+		else
+			impl->cond_signal(&run->cond);
+		w->ops++;
+	}
+	impl->mutex_unlock(&run->mutex);
+}
+
+static void rwlock_setup(struct run *run)
+{
+	run->impl->rwlock_init(&run->rwlock);
+}
+
+static void rwlock_teardown(struct run *run)
+{
+	run->impl->rwlock_destroy(&run->rwlock);
+}
+
+static void rwlock_read(struct worker *w)
+{
+	const struct impl *impl = w->run->impl;
+
+	while (!stopped(w->run)) {
+		impl->rwlock_rdlock(&w->run->rwlock);
+		impl->rwlock_unlock(&w->run->rwlock);
+		w->ops++;
+	}
+}
+
+static void sem_setup(struct run *run)
+{
+	run->impl->sem_init(&run->sem);
+}
+
+static void sem_teardown(struct run *run)
+{
+	run->impl->sem_destroy(&run->sem);
+}
+
+// each thread posts before it waits, so there's always a post left for a
+// thread that's waiting
+static void sem_post_wait(struct worker *w)
+{
+	const struct impl *impl = w->run->impl;
+
+	while (!stopped(w->run)) {
+		impl->sem_post(&w->run->sem);
+		impl->sem_wait(&w->run->sem);
+		w->ops++;
+	}
+}
+
+static void create_join(struct worker *w)
+{
+	const struct impl *impl = w->run->impl;
+
+	while (!stopped(w->run)) {
+		if (impl->create_join(empty_thread))
+			break;
+		w->ops++;
+	}
+}
+
+static void cleanup_push_pop(struct worker *w)
+{
+	const struct impl *impl = w->run->impl;
+
+	while (!stopped(w->run)) {
+		impl->cleanup_push_pop(nop);
+		w->ops++;
+	}
+}
+
+static const struct bench {
+	const char *name;
+	void (*setup)(struct run *run);
+	void (*thread)(struct worker *w);
+	// wakes up threads that may be waiting for others which are done
+	void (*stop)(struct run *run);
+	void (*teardown)(struct run *run);
+	unsigned min_threads;
+} benches[] = {
+	{ "mutex_uncontended", mutex_setup, mutex_uncontended, NULL, mutex_teardown },
+	{ "mutex_contended", mutex_setup, mutex_contended, NULL, mutex_teardown },
+	{ "mutex_static_uncontended", mutex_static_setup, mutex_uncontended, NULL, mutex_teardown },
+	{ "mutex_static_first_use", mutex_static_setup, mutex_static_first_use, NULL, mutex_teardown },
+	{ "cond_pingpong", cond_setup, cond_pingpong, cond_stop, cond_teardown, 2 },
+	{ "cond_static_pingpong", cond_static_setup, cond_pingpong, cond_stop, cond_teardown, 2 },
+	{ "rwlock_read", rwlock_setup, rwlock_read, NULL, rwlock_teardown },
+	{ "sem_post_wait", sem_setup, sem_post_wait, NULL, sem_teardown },
+	{ "create_join", NULL, create_join, NULL, NULL },
+	{ "cleanup_push_pop", NULL, cleanup_push_pop, NULL, NULL },
+};
+
+static const struct bench *current_bench;
+
+static void *worker_main(void *data)
+{
+	struct worker *w = data;
+
+	pthread_barrier_wait(&w->run->start);
+	current_bench->thread(w);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_bench(const struct bench *bench, const struct impl *impl, unsigned threads, unsigned ms)
+{
+	struct run run = { .impl = impl, .threads = threads };
+	struct worker workers[MAX_THREADS] = {0};
+	unsigned started;
+
+	current_bench = bench;
+	if (bench->setup)
+		bench->setup(&run);
+	pthread_barrier_init(&run.start, NULL, threads + 1);
+	for (started = 0; started < threads; started++) {
+		workers[started] = (struct worker){ .run = &run, .index = started };
+		if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]))
+			break;
+	}
+	if (started < threads) {
+		fprintf(stderr, "%s: couldn't start %u threads\n", bench->name, threads);
+		exit(1);
+	}
+
+	pthread_barrier_wait(&run.start);
+	double start = now();
+	usleep(ms * 1000);
+	__atomic_store_n(&run.stop, true, __ATOMIC_RELAXED);
+	if (bench->stop)
+		bench->stop(&run);
+
+	unsigned long long ops = 0;
+	for (unsigned i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+	}
+	double seconds = now() - start;
+
+	pthread_barrier_destroy(&run.start);
+	if (bench->teardown)
+		bench->teardown(&run);
+
+	printf("%s\t%s\t%u\t%llu\t%.6f\t%.2f\n", bench->name, impl->name, threads, ops, seconds,
+	       ops ? seconds * 1e9 * threads / ops : 0);
+	fflush(stdout);
+	return ops ? 0 : 1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-t <threads>,...] [-m <milliseconds per run>] [benchmark...]\nbenchmarks:", argv0);
+	for (size_t i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fputc('\n', stderr);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned thread_counts[32] = { 1, 2, 4, 8 };
+	size_t nthread_counts = 4;
+	unsigned ms = 200;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:m:h")) != -1) {
+		switch (opt) {
+			case 't':
+				nthread_counts = 0;
+				for (char *p = optarg; *p && nthread_counts < ARRAY_SIZE(thread_counts);) {
+					char *end;
+					unsigned long n = strtoul(p, &end, 10);
+					if (end == p || !n || n > MAX_THREADS) {
+						usage(argv[0]);
+						return 2;
+					}
+					thread_counts[nthread_counts++] = n;
+					p = *end == ',' ? end + 1 : end;
+				}
+				break;
+			case 'm':
+				ms = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	printf("# benchmark\timpl\tthreads\tops\tseconds\tns_per_op\n");
+	printf("# %ld CPUs online, %u ms per run\n", sysconf(_SC_NPROCESSORS_ONLN), ms);
+
+	int ret = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(benches); i++) {
+		const struct bench *bench = &benches[i];
+		bool selected = optind == argc;
+		for (int arg = optind; arg < argc; arg++)
+			selected |= !strcmp(argv[arg], bench->name);
+		if (!selected)
+			continue;
+
+		for (size_t j = 0; j < nthread_counts; j++) {
+			if (thread_counts[j] < bench->min_threads)
+				continue;
+			ret |= run_bench(bench, &bionic, thread_counts[j], ms);
+			ret |= run_bench(bench, &host, thread_counts[j], ms);
+		}
+	}
+
+	return ret;
+}
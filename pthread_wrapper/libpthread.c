@@ -1,12 +1,25 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <dlfcn.h>
 #include <unistd.h>
 #include <memory.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <setjmp.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include "bionic_futex.h"
+#include "pthread_bio.h"
 
 // when __GLIBC__ (or some glibc specific symbol) is not defined, we're assuming musl; can't check to be sure because 🤡
 
@@ -47,6 +60,15 @@ typedef struct {
 	};
 } bionic_attr_t;
 
+// On 32-bit, bionic's mutexes and conds are a single word, too small for the
+// glibc ones, so instead of keeping those elsewhere we implement bionic's own
+// on top of futexes, with the same encoding of the state (see the native mutex
+// below). Building with -DNATIVE_FUTEX_LOCKS gets them on LP64 as well.
+#if !defined(__LP64__) || defined(NATIVE_FUTEX_LOCKS)
+#define NATIVE_MUTEX 1
+#define NATIVE_COND 1
+#endif
+
 typedef struct {
 	union {
 #if defined(__LP64__)
@@ -76,6 +98,7 @@ typedef struct {
 	};
 } bionic_rwlock_t;
 
+#ifndef NATIVE_MUTEX
 static const struct {
 	bionic_mutex_t bionic;
 	pthread_mutex_t glibc;
@@ -84,6 +107,7 @@ static const struct {
 	{ .bionic = {{{ ((PTHREAD_MUTEX_RECURSIVE & 3) << 14) }}}, .glibc = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP },
 	{ .bionic = {{{ ((PTHREAD_MUTEX_ERRORCHECK & 3) << 14) }}}, .glibc = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP },
 };
+#endif
 
 typedef struct {
 	union {
@@ -119,7 +143,7 @@ struct bionic_pthread_cleanup_t {
 	union {
 		struct bionic_pthread_cleanup_t *prev;
 #ifdef __GLIBC__
-		__pthread_unwind_buf_t *glibc;
+		struct _pthread_cleanup_buffer *glibc;
 #else
 		struct __ptcb *musl;
 #endif
@@ -129,61 +153,592 @@ struct bionic_pthread_cleanup_t {
 };
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// On LP64 glibc, mutexes, conds and rwlocks fit into the bionic ones, so they
+// can live there directly instead of behind a pointer. Bionic's static
+// initializers are all zeroes like glibc's, apart from the mutex type in bits
+// 14-15 of the first word, which is where glibc keeps the lock state (only
+// ever 0-2 for the mutex types we create): so a mutex with these bits set is
+// translated on first use, by setting the glibc type and clearing the word.
+#if defined(__LP64__) && !defined(NATIVE_MUTEX) && defined(__SIZEOF_PTHREAD_MUTEX_T) && __SIZEOF_PTHREAD_MUTEX_T <= 40
+#define EMBEDDED_MUTEX 1
+_Static_assert(sizeof(pthread_mutex_t) <= sizeof(bionic_mutex_t), "pthread_mutex_t doesn't fit in bionic_mutex_t");
+#endif
+#if defined(__LP64__) && !defined(NATIVE_COND) && defined(__SIZEOF_PTHREAD_COND_T) && __SIZEOF_PTHREAD_COND_T <= 48
+#define EMBEDDED_COND 1
+_Static_assert(sizeof(pthread_cond_t) <= sizeof(bionic_cond_t), "pthread_cond_t doesn't fit in bionic_cond_t");
+// glibc's cond does 64-bit atomics on its sequence counters, so it can only
+// live in a bionic one that happens to be 8-byte aligned; others get theirs
+// out of line, like everything on ILP32
+#define COND_IS_EMBEDDED(cond) (!((uintptr_t)(cond) & (_Alignof(pthread_cond_t) - 1)))
+#else
+#define COND_IS_EMBEDDED(cond) false
+#endif
+#if defined(__LP64__) && defined(__SIZEOF_PTHREAD_RWLOCK_T) && __SIZEOF_PTHREAD_RWLOCK_T <= 56
+#define EMBEDDED_RWLOCK 1
+_Static_assert(sizeof(pthread_rwlock_t) <= sizeof(bionic_rwlock_t), "pthread_rwlock_t doesn't fit in bionic_rwlock_t");
+#endif
 
-// For checking, if our glibc version is mapped to memory.
-// Used for sanity checking and static initialization below.
-#define IS_MAPPED(x) is_mapped(x->glibc, sizeof(x))
+#define BIONIC_MUTEX_TYPE_MASK (3 << 14)
+
+// The pointer to our glibc version is stored with the low bit set, which none
+// of the bionic static initializers (all zeroes, apart from the mutex type in
+// bits 14-15) have. So an object without it still needs its glibc version
+// allocated, and we can tell without making a syscall.
+#define GLIBC_TAG ((uintptr_t)1)
+#define IS_INITIALIZED(x) glibc_is_tagged(&(x)->glibc)
+#define GLIBC(x) ((__typeof__((x)->glibc))((uintptr_t)(x)->glibc & ~GLIBC_TAG))
+#define SET_GLIBC(x, p) ((x)->glibc = (__typeof__((x)->glibc))((uintptr_t)(p) | GLIBC_TAG))
+
+// For handling static initialization: two threads may get here for the same
+// object at once, only the first one to publish its glibc version wins. The
+// init function may fail to allocate one, so this is false if there's none.
+#define INIT_IF_NOT_INITIALIZED(x, init) (likely(IS_INITIALIZED(x)) || (init(x), IS_INITIALIZED(x)))
+#define PUBLISH_GLIBC(x, expected, p) publish_glibc(&(x)->glibc, (expected), (p))
+
+// Bionic's objects are made of int32_ts, so they (and our pointer in there)
+// may only be 4-byte aligned, which 8-byte atomics can't cope with on LP64:
+// aarch64 faults, and x86 takes a split lock. For such objects, the tag is
+// read from the low half of the pointer on its own, and a glibc version is
+// published under a lock, high half first, so that whoever sees the tag also
+// sees the rest of the pointer.
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool glibc_is_misaligned(const void *glibc)
+{
+#ifdef __LP64__
+	return (uintptr_t)glibc & (sizeof(uintptr_t) - 1);
+#else
+	return false;
+#endif
+}
 
-// For handling static initialization.
-#define INIT_IF_NOT_MAPPED(x, init) do { if (!IS_MAPPED(x)) init(x); } while(0)
+static inline bool glibc_is_tagged(const void *glibc)
+{
+	if (unlikely(glibc_is_misaligned(glibc)))
+		return __atomic_load_n((const uint32_t *)glibc, __ATOMIC_ACQUIRE) & GLIBC_TAG;
+	return __atomic_load_n((const uintptr_t *)glibc, __ATOMIC_ACQUIRE) & GLIBC_TAG;
+}
 
-static bool is_mapped(void *mem, const size_t sz)
+// the current value, for publish_glibc() to compare against
+static inline uintptr_t glibc_peek(const void *glibc)
 {
-	const size_t ps = sysconf(_SC_PAGESIZE);
-	assert(ps > 0);
-	unsigned char vec[(sz + ps - 1) / ps];
-	return !mincore(mem, sz, vec);
+	uintptr_t value;
+
+	if (unlikely(glibc_is_misaligned(glibc))) {
+		memcpy(&value, glibc, sizeof(value));
+		return value;
+	}
+	return __atomic_load_n((const uintptr_t *)glibc, __ATOMIC_ACQUIRE);
 }
 
-void bionic___pthread_cleanup_push(struct bionic_pthread_cleanup_t *c, void (*routine)(void*), void *arg)
+static void slab_free(void *mem);
+
+static void publish_glibc(void *glibc, uintptr_t expected, void *p)
 {
-	assert(c && routine);
-#ifdef __GLIBC__
-	c->glibc = mmap(NULL, sizeof(*c->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	c->routine = routine;
-	c->arg = arg;
+	uintptr_t tagged = (uintptr_t)p | GLIBC_TAG;
+
+	if (!p)
+		return;
+	if (expected & GLIBC_TAG) {
+		slab_free(p);
+		return;
+	}
+
+	if (unlikely(glibc_is_misaligned(glibc))) {
+		uint32_t *half = glibc;
+		pthread_mutex_lock(&publish_lock);
+		bool won = glibc_peek(glibc) == expected;
+		if (won) {
+			// little endian, like every bionic target
+			__atomic_store_n(&half[1], (uint32_t)(tagged >> 16 >> 16), __ATOMIC_RELAXED);
+			__atomic_store_n(&half[0], (uint32_t)tagged, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&publish_lock);
+		if (!won)
+			slab_free(p);
+		return;
+	}
+
+	if (!__atomic_compare_exchange_n((uintptr_t *)glibc, &expected, tagged, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		slab_free(p);
+}
+
+/* Storage for the glibc objects behind the bionic ones. These are small (at
+ * most 64 bytes) and apps create thousands of them, so rather than a page
+ * (and a VMA) each, they come from 64-byte slots carved out of bigger
+ * mappings. Each slot gets a cache line of its own, so that locks created
+ * together don't share one. Freed slots are kept on a per-thread free list,
+ * which is refilled from / drained to a global one in batches, so that
+ * init/destroy don't have to take a lock most of the time. Slots are handed
+ * out zeroed, like the anonymous mappings used before. */
+#define SLAB_SLOT_SIZE 64
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_BATCH 32
+
+_Static_assert(sizeof(pthread_mutex_t) <= SLAB_SLOT_SIZE, "pthread_mutex_t doesn't fit in a slab slot");
+_Static_assert(sizeof(pthread_cond_t) <= SLAB_SLOT_SIZE, "pthread_cond_t doesn't fit in a slab slot");
+_Static_assert(sizeof(pthread_rwlock_t) <= SLAB_SLOT_SIZE, "pthread_rwlock_t doesn't fit in a slab slot");
+_Static_assert(sizeof(pthread_attr_t) <= SLAB_SLOT_SIZE, "pthread_attr_t doesn't fit in a slab slot");
+_Static_assert(sizeof(sem_t) <= SLAB_SLOT_SIZE, "sem_t doesn't fit in a slab slot");
+
+struct slab_slot {
+	struct slab_slot *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct slab_slot *free;
+	char *chunk, *chunk_end;
+	pthread_key_t key;
+	pthread_once_t key_once;
+} slab = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.key_once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct {
+	struct slab_slot *free;
+	size_t count;
+	// whether slab_thread_exit() is due to hand the slots back
+	bool registered;
+} slab_cache;
+
+static void slab_drain(size_t count)
+{
+	struct slab_slot *first = slab_cache.free, *last = first;
+
+	for (size_t i = 1; i < count; i++)
+		last = last->next;
+	slab_cache.free = last->next;
+	slab_cache.count -= count;
+
+	pthread_mutex_lock(&slab.lock);
+	last->next = slab.free;
+	slab.free = first;
+	pthread_mutex_unlock(&slab.lock);
+}
+
+static void slab_thread_exit(void *unused)
+{
+	// a later TSD destructor may still free a slot, which registers again
+	slab_cache.registered = false;
+	if (slab_cache.count)
+		slab_drain(slab_cache.count);
+}
+
+static void slab_key_create(void)
+{
+	pthread_key_create(&slab.key, slab_thread_exit);
+}
+
+/* on the thread's first use of its cache, by alloc or free alike: a thread
+ * may well only destroy objects created by others */
+static inline void slab_cache_register(void)
+{
+	if (likely(slab_cache.registered))
+		return;
+	pthread_once(&slab.key_once, slab_key_create);
+	slab_cache.registered = !pthread_setspecific(slab.key, &slab_cache);
+}
 
-	int not_first_call;
-	if ((not_first_call = sigsetjmp((struct __jmp_buf_tag*)(void*)c->glibc->__cancel_jmp_buf, 0))) {
-		routine(arg);
-		__pthread_unwind_next(c->glibc);
+static bool slab_refill(void)
+{
+	pthread_mutex_lock(&slab.lock);
+	while (slab_cache.count < SLAB_BATCH) {
+		struct slab_slot *slot = slab.free;
+		if (slot) {
+			slab.free = slot->next;
+		} else {
+			if (slab.chunk == slab.chunk_end) {
+				void *chunk = mmap(NULL, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+				if (chunk == MAP_FAILED)
+					break;
+				slab.chunk = chunk;
+				slab.chunk_end = slab.chunk + SLAB_CHUNK_SIZE;
+			}
+			slot = (struct slab_slot *)slab.chunk;
+			slab.chunk += SLAB_SLOT_SIZE;
+		}
+		slot->next = slab_cache.free;
+		slab_cache.free = slot;
+		slab_cache.count++;
 	}
+	pthread_mutex_unlock(&slab.lock);
+
+	return slab_cache.count;
+}
+
+static void *slab_alloc(void)
+{
+	slab_cache_register();
+	if (!slab_cache.free && !slab_refill())
+		return NULL;
+
+	struct slab_slot *slot = slab_cache.free;
+	slab_cache.free = slot->next;
+	slab_cache.count--;
+	memset(slot, 0, SLAB_SLOT_SIZE);
+	return slot;
+}
+
+static void slab_free(void *mem)
+{
+	struct slab_slot *slot = mem;
+
+	slab_cache_register();
+	slot->next = slab_cache.free;
+	slab_cache.free = slot;
+	if (++slab_cache.count > 2 * SLAB_BATCH)
+		slab_drain(SLAB_BATCH);
+}
+
+/* The cleanup buffers nest like the scopes of the push/pop pairs they belong
+ * to, so on glibc they're taken from a small per-thread stack rather than
+ * mapped each time; only deeper nesting than that falls back to mmap. A pop
+ * also drops anything above its own buffer, in case some scope was left
+ * without one. On musl, a __ptcb is no bigger than bionic's cleanup struct, so
+ * the latter is used as one, right in the caller's frame.
+ *
+ * On glibc, these are the old-style cleanup buffers, which the unwinder runs
+ * on cancellation by itself: the sigsetjmp() based ones need the jump buffer
+ * set up in the frame of the caller, not in ours, which is gone by the time
+ * the thread is cancelled. */
+#ifdef __GLIBC__
+#define CLEANUP_STACK_SIZE 16
+
+extern void _pthread_cleanup_push(struct _pthread_cleanup_buffer *buffer, void (*routine)(void*), void *arg);
+extern void _pthread_cleanup_pop(struct _pthread_cleanup_buffer *buffer, int execute);
 
-	__pthread_register_cancel(c->glibc);
+static __thread struct {
+	struct _pthread_cleanup_buffer buf[CLEANUP_STACK_SIZE];
+	size_t depth;
+} cleanup_stack;
 #else
-	c->musl = mmap(NULL, sizeof(struct __ptcb), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+_Static_assert(sizeof(struct __ptcb) <= sizeof(struct bionic_pthread_cleanup_t), "struct __ptcb doesn't fit in bionic's cleanup struct");
+#endif
+
+void bionic___pthread_cleanup_push(struct bionic_pthread_cleanup_t *c, void (*routine)(void*), void *arg)
+{
+	assert(c && routine);
+#ifdef __GLIBC__
+	if (cleanup_stack.depth < CLEANUP_STACK_SIZE)
+		c->glibc = &cleanup_stack.buf[cleanup_stack.depth++];
+	else
+		c->glibc = mmap(NULL, sizeof(*c->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 	c->routine = routine;
 	c->arg = arg;
-	_pthread_cleanup_push(c->musl, routine, arg);
+	_pthread_cleanup_push(c->glibc, routine, arg);
+#else
+	_pthread_cleanup_push((struct __ptcb *)c, routine, arg);
 #endif
 }
 
 void bionic___pthread_cleanup_pop(struct bionic_pthread_cleanup_t *c, int execute)
 {
 #ifdef __GLIBC__
-	assert(c && IS_MAPPED(c)); // TODO - analogically for musl?
-	__pthread_unregister_cancel(c->glibc);
-
-	if (execute)
-		c->routine(c->arg);
+	assert(c && c->glibc); // TODO - analogically for musl?
+	_pthread_cleanup_pop(c->glibc, execute);
 
-	munmap(c->glibc, sizeof(*c->glibc));
+	if (c->glibc >= cleanup_stack.buf && c->glibc < cleanup_stack.buf + CLEANUP_STACK_SIZE)
+		cleanup_stack.depth = c->glibc - cleanup_stack.buf;
+	else
+		munmap(c->glibc, sizeof(*c->glibc));
 #else
-	_pthread_cleanup_pop(c->musl, execute);
-	munmap(c->musl, sizeof(struct __ptcb));
+	_pthread_cleanup_pop((struct __ptcb *)c, execute);
 #endif
 }
 
+static void timespec_add(struct timespec *ts, const struct timespec *rel)
+{
+	ts->tv_sec += rel->tv_sec;
+	ts->tv_nsec += rel->tv_nsec;
+	if (ts->tv_nsec >= 1000000000) {
+		++ts->tv_sec;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- */
+
+/* symbolization, for the reports below */
+
+static int (*linker_dladdr)(const void *addr, Dl_info *info);
+static int (*linker_try_dladdr)(const void *addr, Dl_info *info);
+static pthread_once_t linker_dladdr_once = PTHREAD_ONCE_INIT;
+
+static void linker_dladdr_lookup(void)
+{
+	linker_dladdr = dlsym(RTLD_DEFAULT, "bionic_dladdr");
+	linker_try_dladdr = dlsym(RTLD_DEFAULT, "dl_try_addr");
+}
+
+/* goes through the bionic linker's dladdr first, the host's one doesn't know
+ * about the libraries loaded by the former */
+static bool symbolize(const void *addr, Dl_info *info)
+{
+	pthread_once(&linker_dladdr_once, linker_dladdr_lookup);
+	return (linker_dladdr && linker_dladdr(addr, info)) || dladdr(addr, info);
+}
+
+/* the same without waiting for the bionic linker, which holds its lock while
+ * running constructors, that may be waiting for the caller; the libraries it
+ * loaded are unknown while another thread is loading more */
+static bool try_symbolize(const void *addr, Dl_info *info)
+{
+	pthread_once(&linker_dladdr_once, linker_dladdr_lookup);
+	return (linker_try_dladdr && linker_try_dladdr(addr, info) > 0) || dladdr(addr, info);
+}
+
+static void print_symbolized(FILE *out, const void *addr)
+{
+	Dl_info info;
+
+	fprintf(out, "\t%p", addr);
+	if (symbolize(addr, &info)) {
+		const char *name = strrchr(info.dli_fname, '/');
+		fprintf(out, " (%s", name ? name + 1 : info.dli_fname);
+		if (info.dli_sname)
+			fprintf(out, ": %s+0x%tx)", info.dli_sname, (const char *)addr - (const char *)info.dli_saddr);
+		else
+			fprintf(out, "+0x%tx)", (const char *)addr - (const char *)info.dli_fbase);
+	}
+}
+
+/* ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- */
+
+/* lock profiling */
+
+/* With BIONIC_PTHREAD_LOCK_PROFILE set to a file name (or "-" for stderr),
+ * mutex and rwlock locking first tries to take the lock without blocking, and
+ * only when that fails records how long it waited, who held the lock and who
+ * called, as do cond waits. Records are summed up per lock and caller in a
+ * table of each thread's own, which goes into a global one when the thread
+ * exits; the top entries are written out at exit, symbolized through the bionic
+ * linker's dladdr where it knows the address. Cond waits are mostly threads
+ * idling until there's work, not contention, so they get a ranking of their
+ * own after the locks'. */
+#define LOCK_PROFILE_SLOTS 256
+#define LOCK_PROFILE_REPORT_MAX 50
+
+enum lock_profile_kind {
+	LOCK_PROFILE_MUTEX,
+	LOCK_PROFILE_RDLOCK,
+	LOCK_PROFILE_WRLOCK,
+	LOCK_PROFILE_COND,
+};
+
+static const char *const lock_profile_kind_names[] = {
+	[LOCK_PROFILE_MUTEX] = "mutex",
+	[LOCK_PROFILE_RDLOCK] = "rdlock",
+	[LOCK_PROFILE_WRLOCK] = "wrlock",
+	[LOCK_PROFILE_COND] = "cond",
+};
+
+struct lock_profile_entry {
+	const void *lock;
+	const void *caller;
+	uint64_t count;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	pid_t holder; // of the longest wait
+	enum lock_profile_kind kind;
+};
+
+struct lock_profile_table {
+	struct lock_profile_table *next, **prev;
+	size_t dropped;
+	struct lock_profile_entry entries[LOCK_PROFILE_SLOTS];
+};
+
+static struct {
+	bool enabled;
+	const char *path;
+	pthread_mutex_t lock;
+	pthread_key_t key;
+	struct lock_profile_table *threads; // the live ones
+	struct lock_profile_table exited;
+} lock_profile = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct lock_profile_table *lock_profile_table;
+
+static uint64_t lock_profile_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lock_profile_add(struct lock_profile_table *table, const struct lock_profile_entry *e)
+{
+	size_t hash = ((uintptr_t)e->lock ^ ((uintptr_t)e->caller * 31)) >> 3;
+
+	for (size_t i = 0; i < LOCK_PROFILE_SLOTS; i++) {
+		struct lock_profile_entry *slot = &table->entries[(hash + i) % LOCK_PROFILE_SLOTS];
+		if (!slot->count) {
+			*slot = *e;
+			return;
+		}
+		if (slot->lock == e->lock && slot->caller == e->caller && slot->kind == e->kind) {
+			slot->count += e->count;
+			slot->wait_ns += e->wait_ns;
+			if (e->max_wait_ns > slot->max_wait_ns) {
+				slot->max_wait_ns = e->max_wait_ns;
+				slot->holder = e->holder;
+			}
+			return;
+		}
+	}
+	table->dropped += e->count;
+}
+
+static void lock_profile_merge_locked(struct lock_profile_table *into, const struct lock_profile_table *table)
+{
+	for (size_t i = 0; i < LOCK_PROFILE_SLOTS; i++) {
+		if (table->entries[i].count)
+			lock_profile_add(into, &table->entries[i]);
+	}
+	into->dropped += table->dropped;
+}
+
+static void lock_profile_thread_exit(void *data)
+{
+	struct lock_profile_table *table = data;
+
+	pthread_mutex_lock(&lock_profile.lock);
+	*table->prev = table->next;
+	if (table->next)
+		table->next->prev = table->prev;
+	lock_profile_merge_locked(&lock_profile.exited, table);
+	pthread_mutex_unlock(&lock_profile.lock);
+
+	lock_profile_table = NULL;
+	free(table);
+}
+
+static void lock_profile_record(enum lock_profile_kind kind, const void *lock, const void *caller, pid_t holder, uint64_t start)
+{
+	uint64_t wait = lock_profile_now() - start;
+
+	if (unlikely(!lock_profile_table)) {
+		struct lock_profile_table *table = calloc(1, sizeof(*table));
+		if (!table)
+			return;
+
+		pthread_mutex_lock(&lock_profile.lock);
+		table->next = lock_profile.threads;
+		table->prev = &lock_profile.threads;
+		if (table->next)
+			table->next->prev = &table->next;
+		lock_profile.threads = table;
+		pthread_mutex_unlock(&lock_profile.lock);
+
+		pthread_setspecific(lock_profile.key, table);
+		lock_profile_table = table;
+	}
+
+	lock_profile_add(lock_profile_table, &(struct lock_profile_entry){
+		.lock = lock,
+		.caller = caller,
+		.count = 1,
+		.wait_ns = wait,
+		.max_wait_ns = wait,
+		.holder = holder,
+		.kind = kind,
+	});
+}
+
+static int lock_profile_compare(const void *a, const void *b)
+{
+	const struct lock_profile_entry *x = a, *y = b;
+	// empty slots go last, so the report can stop at the first one
+	if (!x->count != !y->count)
+		return !x->count - !y->count;
+	return (x->wait_ns < y->wait_ns) - (x->wait_ns > y->wait_ns);
+}
+
+static void lock_profile_print(FILE *out, const struct lock_profile_table *all, bool cond)
+{
+	size_t printed = 0;
+
+	for (size_t i = 0; i < LOCK_PROFILE_SLOTS && printed < LOCK_PROFILE_REPORT_MAX && all->entries[i].count; i++) {
+		const struct lock_profile_entry *e = &all->entries[i];
+		if ((e->kind == LOCK_PROFILE_COND) != cond)
+			continue;
+
+		fprintf(out, "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%d", lock_profile_kind_names[e->kind], e->count, e->wait_ns / 1000, e->max_wait_ns / 1000, e->holder);
+		print_symbolized(out, e->lock);
+		print_symbolized(out, e->caller);
+		fputc('\n', out);
+		printed++;
+	}
+}
+
+static void lock_profile_report(void)
+{
+	struct lock_profile_table *all = calloc(1, sizeof(*all));
+	if (!all)
+		return;
+
+	// the threads still running may be adding to their tables; we can live with that
+	pthread_mutex_lock(&lock_profile.lock);
+	lock_profile_merge_locked(all, &lock_profile.exited);
+	for (struct lock_profile_table *table = lock_profile.threads; table; table = table->next)
+		lock_profile_merge_locked(all, table);
+	pthread_mutex_unlock(&lock_profile.lock);
+
+	qsort(all->entries, LOCK_PROFILE_SLOTS, sizeof(all->entries[0]), lock_profile_compare);
+
+	FILE *out = strcmp(lock_profile.path, "-") ? fopen(lock_profile.path, "w") : stderr;
+	if (!out) {
+		free(all);
+		return;
+	}
+
+	fprintf(out, "# kind\tcount\ttotal_us\tmax_us\tholder\tlock\tcaller\n");
+	lock_profile_print(out, all, false);
+	fprintf(out, "# cond waits\n");
+	lock_profile_print(out, all, true);
+	if (all->dropped)
+		fprintf(out, "# %zu waits didn't fit in the tables\n", all->dropped);
+
+	if (out != stderr)
+		fclose(out);
+	free(all);
+}
+
+__attribute__((constructor)) static void lock_profile_init(void)
+{
+	lock_profile.path = getenv("BIONIC_PTHREAD_LOCK_PROFILE");
+	if (!lock_profile.path || !*lock_profile.path)
+		return;
+
+	if (pthread_key_create(&lock_profile.key, lock_profile_thread_exit))
+		return;
+	atexit(lock_profile_report);
+	lock_profile.enabled = true;
+}
+
+// runs `wait`, recording how long it took with lock profiling on
+#define LOCK_PROFILE_WAIT(kind, lock, wait) ({ \
+		int _ret; \
+		if (unlikely(lock_profile.enabled)) { \
+			uint64_t _start = lock_profile_now(); \
+			_ret = (wait); \
+			lock_profile_record((kind), (lock), __builtin_return_address(0), 0, _start); \
+		} else { \
+			_ret = (wait); \
+		} \
+		_ret; \
+	})
+
 /* ---------------------------------------------------------------------------------------------- *
  * ---------------------------------------------------------------------------------------------- *
  * ---------------------------------------------------------------------------------------------- */
@@ -194,9 +749,10 @@ int bionic_sem_destroy(bionic_sem_t *sem)
 {
 	assert(sem);
 	int ret = 0;
-	if (IS_MAPPED(sem)) {
-		ret = sem_destroy(sem->glibc);
-		munmap(sem->glibc, sizeof(*sem->glibc));
+	if (IS_INITIALIZED(sem)) {
+		ret = sem_destroy(GLIBC(sem));
+		slab_free(GLIBC(sem));
+		sem->glibc = NULL;
 	}
 	return ret;
 }
@@ -205,8 +761,7 @@ static void default_sem_init(bionic_sem_t *sem)
 {
 	// Apparently some android apps (hearthstone) do not call sem_init()
 	assert(sem);
-	sem->glibc = mmap(NULL, sizeof(*sem->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	memset(sem->glibc, 0, sizeof(*sem->glibc));
+	PUBLISH_GLIBC(sem, glibc_peek(&sem->glibc), slab_alloc());
 }
 
 int bionic_sem_init(bionic_sem_t *sem, int pshared, unsigned int value)
@@ -215,36 +770,53 @@ int bionic_sem_init(bionic_sem_t *sem, int pshared, unsigned int value)
 	// From SEM_INIT(3)
 	// Initializing a semaphore that has already been initialized results in underined behavior.
 	*sem = (bionic_sem_t){0};
-	sem->glibc = mmap(NULL, sizeof(*sem->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return sem_init(sem->glibc, pshared, value);
+	sem_t *glibc = slab_alloc();
+	if (!glibc) {
+		errno = ENOMEM;
+		return -1;
+	}
+	SET_GLIBC(sem, glibc);
+	return sem_init(GLIBC(sem), pshared, value);
 }
 
 int bionic_sem_post(bionic_sem_t *sem)
 {
 	assert(sem);
-	INIT_IF_NOT_MAPPED(sem, default_sem_init);
-	return sem_post(sem->glibc);
+	if (!INIT_IF_NOT_INITIALIZED(sem, default_sem_init)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return sem_post(GLIBC(sem));
 }
 
 int bionic_sem_wait(bionic_sem_t *sem)
 {
 	assert(sem);
-	INIT_IF_NOT_MAPPED(sem, default_sem_init);
-	return sem_wait(sem->glibc);
+	if (!INIT_IF_NOT_INITIALIZED(sem, default_sem_init)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return sem_wait(GLIBC(sem));
 }
 
 int bionic_sem_trywait(bionic_sem_t *sem)
 {
 	assert(sem);
-	INIT_IF_NOT_MAPPED(sem, default_sem_init);
-	return sem_trywait(sem->glibc);
+	if (!INIT_IF_NOT_INITIALIZED(sem, default_sem_init)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return sem_trywait(GLIBC(sem));
 }
 
 int bionic_sem_timedwait(bionic_sem_t *sem, const struct timespec *abs_timeout)
 {
 	assert(sem && abs_timeout);
-	INIT_IF_NOT_MAPPED(sem, default_sem_init);
-	return sem_timedwait(sem->glibc, abs_timeout);
+	if (!INIT_IF_NOT_INITIALIZED(sem, default_sem_init)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return sem_timedwait(GLIBC(sem), abs_timeout);
 }
 
 /* ---------------------------------------------------------------------------------------------- *
@@ -253,52 +825,101 @@ int bionic_sem_timedwait(bionic_sem_t *sem, const struct timespec *abs_timeout)
 
 /* rwlock */
 
+#ifndef EMBEDDED_RWLOCK
+static void default_rwlock_init(bionic_rwlock_t *rwlock)
+{
+	// Apparently some android apps/libs (Qt5) do not call pthread_rwlock_init()
+	assert(rwlock);
+	PUBLISH_GLIBC(rwlock, glibc_peek(&rwlock->glibc), slab_alloc());
+}
+#endif
+
+static inline pthread_rwlock_t *glibc_rwlock(bionic_rwlock_t *rwlock)
+{
+#ifdef EMBEDDED_RWLOCK
+	return (pthread_rwlock_t *)rwlock;
+#else
+	return INIT_IF_NOT_INITIALIZED(rwlock, default_rwlock_init) ? GLIBC(rwlock) : NULL;
+#endif
+}
+
 int bionic_pthread_rwlock_destroy(bionic_rwlock_t *rwlock)
 {
 	assert(rwlock);
+#ifdef EMBEDDED_RWLOCK
+	return pthread_rwlock_destroy(glibc_rwlock(rwlock));
+#else
 	int ret = 0;
-	if (IS_MAPPED(rwlock)) {
-		ret = pthread_rwlock_destroy(rwlock->glibc);
-		munmap(rwlock->glibc, sizeof(*rwlock->glibc));
+	if (IS_INITIALIZED(rwlock)) {
+		ret = pthread_rwlock_destroy(GLIBC(rwlock));
+		slab_free(GLIBC(rwlock));
+		rwlock->glibc = NULL;
 	}
 	return ret;
-
+#endif
 }
 
-static void default_rwlock_init(bionic_rwlock_t *rwlock)
+int bionic_pthread_rwlock_init(bionic_rwlock_t *restrict rwlock, const bionic_rwlockattr_t *restrict attr)
 {
-	// Apparently some android apps/libs (Qt5) do not call pthread_rwlock_init()
 	assert(rwlock);
-	rwlock->glibc = mmap(NULL, sizeof(*rwlock->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	memset(rwlock->glibc, 0, sizeof(*rwlock->glibc));
+#ifndef EMBEDDED_RWLOCK
+	pthread_rwlock_t *glibc = slab_alloc();
+	if (!glibc)
+		return ENOMEM;
+	SET_GLIBC(rwlock, glibc);
+#endif
+	return pthread_rwlock_init(glibc_rwlock(rwlock), (pthread_rwlockattr_t *)attr);
 }
 
-int bionic_pthread_rwlock_init(bionic_rwlock_t *restrict rwlock, const bionic_rwlockattr_t *restrict attr)
+static int __attribute__((noinline)) profiled_rwlock_lock(bionic_rwlock_t *rwlock, bool write, const void *caller)
 {
-	assert(rwlock);
-	rwlock->glibc = mmap(NULL, sizeof(*rwlock->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return pthread_rwlock_init(rwlock->glibc, (pthread_rwlockattr_t *)attr);
+	pthread_rwlock_t *glibc = glibc_rwlock(rwlock);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	if (!(write ? pthread_rwlock_trywrlock(glibc) : pthread_rwlock_tryrdlock(glibc)))
+		return 0;
+
+#ifdef __GLIBC__
+	pid_t holder = __atomic_load_n(&glibc->__data.__cur_writer, __ATOMIC_RELAXED);
+#else
+	pid_t holder = 0;
+#endif
+	uint64_t start = lock_profile_now();
+	int ret = write ? pthread_rwlock_wrlock(glibc) : pthread_rwlock_rdlock(glibc);
+	if (!ret)
+		lock_profile_record(write ? LOCK_PROFILE_WRLOCK : LOCK_PROFILE_RDLOCK, rwlock, caller, holder, start);
+	return ret;
 }
 
 int bionic_pthread_rwlock_rdlock(bionic_rwlock_t *rwlock)
 {
 	assert(rwlock);
-	INIT_IF_NOT_MAPPED(rwlock, default_rwlock_init);
-	return pthread_rwlock_rdlock(rwlock->glibc);
+	if (unlikely(lock_profile.enabled))
+		return profiled_rwlock_lock(rwlock, false, __builtin_return_address(0));
+	pthread_rwlock_t *glibc = glibc_rwlock(rwlock);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_rwlock_rdlock(glibc);
 }
 
 int bionic_pthread_rwlock_unlock(bionic_rwlock_t *rwlock)
 {
 	assert(rwlock);
-	INIT_IF_NOT_MAPPED(rwlock, default_rwlock_init);
-	return pthread_rwlock_unlock(rwlock->glibc);
+	pthread_rwlock_t *glibc = glibc_rwlock(rwlock);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_rwlock_unlock(glibc);
 }
 
 int bionic_pthread_rwlock_wrlock(bionic_rwlock_t *rwlock)
 {
 	assert(rwlock);
-	INIT_IF_NOT_MAPPED(rwlock, default_rwlock_init);
-	return pthread_rwlock_wrlock(rwlock->glibc);
+	if (unlikely(lock_profile.enabled))
+		return profiled_rwlock_lock(rwlock, true, __builtin_return_address(0));
+	pthread_rwlock_t *glibc = glibc_rwlock(rwlock);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_rwlock_wrlock(glibc);
 }
 
 /* ---------------------------------------------------------------------------------------------- *
@@ -311,9 +932,10 @@ int bionic_pthread_attr_destroy(bionic_attr_t *attr)
 {
 	assert(attr);
 	int ret = 0;
-	if (IS_MAPPED(attr)) {
-		ret = pthread_attr_destroy(attr->glibc);
-		munmap(attr->glibc, sizeof(*attr->glibc));
+	if (IS_INITIALIZED(attr)) {
+		ret = pthread_attr_destroy(GLIBC(attr));
+		slab_free(GLIBC(attr));
+		attr->glibc = NULL;
 	}
 	return ret;
 }
@@ -324,195 +946,1421 @@ int bionic_pthread_attr_init(bionic_attr_t *attr)
 	// From PTHREAD_ATTR_INIT(3)
 	// Calling `pthread_attr_init` on a thread attributes object that has already been initialized results in ud.
 	*attr = (bionic_attr_t){0};
-	attr->glibc = mmap(NULL, sizeof(*attr->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return pthread_attr_init(attr->glibc);
+	void *glibc = slab_alloc();
+	if (!glibc)
+		return ENOMEM;
+	SET_GLIBC(attr, glibc);
+	return pthread_attr_init(GLIBC(attr));
 }
 
 int bionic_pthread_getattr_np(bionic_pthread_t thread, bionic_attr_t *attr)
 {
 	assert(thread && attr);
 	*attr = (bionic_attr_t){0};
-	attr->glibc = mmap(NULL, sizeof(*attr->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return pthread_getattr_np((pthread_t)thread, attr->glibc);
+	void *glibc = slab_alloc();
+	if (!glibc)
+		return ENOMEM;
+	SET_GLIBC(attr, glibc);
+	return pthread_getattr_np((pthread_t)thread, GLIBC(attr));
 }
 
 int bionic_pthread_attr_settstack(bionic_attr_t *attr, void *stackaddr, size_t stacksize)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_setstack(attr->glibc, stackaddr, stacksize);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_setstack(GLIBC(attr), stackaddr, stacksize);
 }
 
 int bionic_pthread_attr_getstack(const bionic_attr_t *attr, void *stackaddr, size_t *stacksize)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_getstack(attr->glibc, stackaddr, stacksize);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_getstack(GLIBC(attr), stackaddr, stacksize);
 }
 
 int bionic_pthread_attr_setstacksize(bionic_attr_t *attr, size_t stacksize)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_setstacksize(attr->glibc, stacksize);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_setstacksize(GLIBC(attr), stacksize);
 }
 
 int bionic_pthread_attr_getstacksize(const bionic_attr_t *attr, size_t *stacksize)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_getstacksize(attr->glibc, stacksize);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_getstacksize(GLIBC(attr), stacksize);
 }
 
 int bionic_pthread_attr_setschedpolicy(bionic_attr_t *attr, int policy)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_setschedpolicy(attr->glibc, policy);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_setschedpolicy(GLIBC(attr), policy);
 }
 
 int bionic_pthread_attr_getschedpolicy(bionic_attr_t *attr, int *policy)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_getschedpolicy(attr->glibc, policy);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_getschedpolicy(GLIBC(attr), policy);
 }
 
 int bionic_pthread_attr_setschedparam(bionic_attr_t *attr, const struct sched_param *param)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_setschedparam(attr->glibc, param);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_setschedparam(GLIBC(attr), param);
 }
 
 int bionic_pthread_attr_getschedparam(bionic_attr_t *attr, struct sched_param *param)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_getschedparam(attr->glibc, param);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_getschedparam(GLIBC(attr), param);
 }
 
 int bionic_pthread_attr_setdetachstate(bionic_attr_t *attr, int detachstate)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_setdetachstate(attr->glibc, detachstate);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_setdetachstate(GLIBC(attr), detachstate);
 }
 
 int bionic_pthread_attr_getdetachstate(bionic_attr_t *attr, int *detachstate)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_attr_getdetachstate(attr->glibc, detachstate);
-}
-
-int bionic_pthread_create(bionic_pthread_t *thread, const bionic_attr_t *attr, void* (*start)(void*), void *arg)
-{
-	assert(thread && (!attr || IS_MAPPED(attr)));
-	return pthread_create((pthread_t*)thread, (attr ? attr->glibc : NULL), start, arg);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_attr_getdetachstate(GLIBC(attr), detachstate);
 }
 
-/* ---------------------------------------------------------------------------------------------- *
- * ---------------------------------------------------------------------------------------------- *
- * ---------------------------------------------------------------------------------------------- */
+/* With BIONIC_PTHREAD_STACK_CACHE set to a size (with an optional K, M or G
+ * suffix), the stacks of the app's threads are allocated here rather than by
+ * the host libc, and kept around once their thread is done with them, up to
+ * that many bytes, for the next thread asking for the same stack and guard
+ * size: so apps starting a thread per task don't map and unmap a stack (and
+ * set up a guard page) each time. A stack is only reused once nothing can
+ * touch it anymore: for a joinable thread, that's after it has been joined,
+ * and for a detached one, once the thread is gone; the latter are looked for
+ * whenever a thread is created. Threads given a stack by the app are left
+ * alone. */
+#define STACK_CACHE_MAX_STACKS 64
+
+struct cached_stack {
+	struct cached_stack *next;
+	char *base; // including the guard
+	size_t size, guard;
+	pthread_t thread;
+	pid_t tid;
+	bool joinable;
+};
 
-/* mutexattr */
+static struct {
+	bool enabled;
+	size_t max_bytes;
+	pthread_mutex_t lock;
+	struct cached_stack *used, *free;
+	struct pthread_stack_cache_stats stats;
+} stack_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-int bionic_pthread_mutexattr_settype(bionic_mutexattr_t *attr, int type)
+static void stack_cache_release_locked(struct cached_stack *stack)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_mutexattr_settype(attr->glibc, type);
+	if (stack_cache.stats.cached_stacks < STACK_CACHE_MAX_STACKS &&
+	    stack_cache.stats.cached_bytes + stack->size + stack->guard <= stack_cache.max_bytes) {
+		stack->next = stack_cache.free;
+		stack_cache.free = stack;
+		stack_cache.stats.cached_stacks++;
+		stack_cache.stats.cached_bytes += stack->size + stack->guard;
+		stack_cache.stats.released++;
+	} else {
+		munmap(stack->base, stack->size + stack->guard);
+		free(stack);
+		stack_cache.stats.evicted++;
+	}
 }
 
-int bionic_pthread_mutexattr_destroy(bionic_mutexattr_t *attr)
+// detached threads that are gone don't need their stacks anymore
+static void stack_cache_reap_locked(void)
 {
-	assert(attr);
-	int ret = 0;
-	if (IS_MAPPED(attr)) {
-		ret = pthread_mutexattr_destroy(attr->glibc);
-		munmap(attr->glibc, sizeof(*attr->glibc));
+	for (struct cached_stack **p = &stack_cache.used; *p;) {
+		struct cached_stack *stack = *p;
+		if (!stack->joinable && stack->tid && syscall(__NR_tgkill, getpid(), stack->tid, 0) && errno == ESRCH) {
+			*p = stack->next;
+			stack_cache_release_locked(stack);
+		} else {
+			p = &stack->next;
+		}
 	}
-	return ret;
 }
 
-int bionic_pthread_mutexattr_init(bionic_mutexattr_t *attr)
+/* sets up `stack_attr` like `attr`, with a stack from the cache, if `attr`
+ * doesn't come with one */
+static struct cached_stack *stack_cache_get(const pthread_attr_t *attr, pthread_attr_t *stack_attr)
 {
-	assert(attr);
-	// From PTHREAD_MUTEXATTR_INIT(3)
-	// The results of initializing an already initialized mutex attributes object are undefined.
-	*attr = (bionic_mutexattr_t){0};
-	attr->glibc = mmap(NULL, sizeof(*attr->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return pthread_mutexattr_init(attr->glibc);
+	pthread_attr_t default_attr;
+	size_t size, guard;
+	int detachstate, policy, inheritsched;
+	struct sched_param param;
+	void *addr;
+
+	if (!attr) {
+		pthread_attr_init(&default_attr);
+		attr = &default_attr;
+	} else if (!pthread_attr_getstack(attr, &addr, &size) && (uintptr_t)addr + size != 0) {
+		return NULL;
+	}
+	pthread_attr_getstacksize(attr, &size);
+	pthread_attr_getguardsize(attr, &guard);
+	pthread_attr_getdetachstate(attr, &detachstate);
+	pthread_attr_getinheritsched(attr, &inheritsched);
+	pthread_attr_getschedpolicy(attr, &policy);
+	pthread_attr_getschedparam(attr, &param);
+	if (attr == &default_attr)
+		pthread_attr_destroy(&default_attr);
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size = (size + page_size - 1) & ~(page_size - 1);
+	guard = (guard + page_size - 1) & ~(page_size - 1);
+
+	pthread_mutex_lock(&stack_cache.lock);
+	stack_cache_reap_locked();
+	struct cached_stack *stack = NULL;
+	for (struct cached_stack **p = &stack_cache.free; *p; p = &(*p)->next) {
+		if ((*p)->size == size && (*p)->guard == guard) {
+			stack = *p;
+			*p = stack->next;
+			stack_cache.stats.cached_stacks--;
+			stack_cache.stats.cached_bytes -= size + guard;
+			stack_cache.stats.hits++;
+			break;
+		}
+	}
+	if (!stack)
+		stack_cache.stats.misses++;
+	pthread_mutex_unlock(&stack_cache.lock);
+
+	if (!stack) {
+		stack = calloc(1, sizeof(*stack));
+		if (!stack)
+			return NULL;
+		stack->base = mmap(NULL, size + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (stack->base == MAP_FAILED) {
+			free(stack);
+			return NULL;
+		}
+		if (guard)
+			mprotect(stack->base, guard, PROT_NONE);
+		stack->size = size;
+		stack->guard = guard;
+	}
+	stack->tid = 0;
+	stack->joinable = detachstate == PTHREAD_CREATE_JOINABLE;
+
+	pthread_attr_init(stack_attr);
+	pthread_attr_setstack(stack_attr, stack->base + guard, size);
+	pthread_attr_setdetachstate(stack_attr, detachstate);
+	pthread_attr_setinheritsched(stack_attr, inheritsched);
+	pthread_attr_setschedpolicy(stack_attr, policy);
+	pthread_attr_setschedparam(stack_attr, &param);
+	return stack;
 }
 
-/* ---------------------------------------------------------------------------------------------- *
- * ---------------------------------------------------------------------------------------------- *
- * ---------------------------------------------------------------------------------------------- */
-
-/* mutex */
-
-static void default_pthread_mutex_init(bionic_mutex_t *mutex)
+// the thread is on its way, or failed to be created if `thread` is NULL
+static void stack_cache_put(struct cached_stack *stack, const pthread_t *thread)
 {
-	assert(mutex);
-
-	for (size_t i = 0; i < ARRAY_SIZE(bionic_mutex_init_map); i++) {
-		if (memcmp(&bionic_mutex_init_map[i].bionic, mutex, sizeof(*mutex)))
-			continue;
-
-		mutex->glibc = mmap(NULL, sizeof(*mutex->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-		memcpy(mutex->glibc, &bionic_mutex_init_map[i].glibc, sizeof(bionic_mutex_init_map[i].glibc));
-		return;
+	pthread_mutex_lock(&stack_cache.lock);
+	if (thread) {
+		stack->thread = *thread;
+		stack->next = stack_cache.used;
+		stack_cache.used = stack;
+	} else {
+		stack_cache_release_locked(stack);
 	}
+	pthread_mutex_unlock(&stack_cache.lock);
+}
 
-	assert(0 && "no such default initializer???");
+// called from the thread itself, before it runs any of the app's code
+static void stack_cache_started(struct cached_stack *stack)
+{
+	pthread_mutex_lock(&stack_cache.lock);
+	stack->thread = pthread_self();
+	stack->tid = syscall(__NR_gettid);
+	pthread_mutex_unlock(&stack_cache.lock);
 }
 
-int bionic_pthread_mutex_destroy(bionic_mutex_t *mutex)
+static void stack_cache_joined_or_detached(pthread_t thread, bool joined)
 {
-	assert(mutex);
-	int ret = 0;
-	if (IS_MAPPED(mutex)) {
-		ret = pthread_mutex_destroy(mutex->glibc);
-		munmap(mutex->glibc, sizeof(*mutex->glibc));
+	pthread_mutex_lock(&stack_cache.lock);
+	for (struct cached_stack **p = &stack_cache.used; *p; p = &(*p)->next) {
+		struct cached_stack *stack = *p;
+		if (!stack->joinable || !pthread_equal(stack->thread, thread))
+			continue;
+		if (joined) {
+			*p = stack->next;
+			stack_cache_release_locked(stack);
+		} else {
+			stack->joinable = false;
+		}
+		break;
 	}
-	return ret;
+	pthread_mutex_unlock(&stack_cache.lock);
 }
 
-int bionic_pthread_mutex_init(bionic_mutex_t *mutex, const bionic_mutexattr_t *attr)
+void pthread_get_stack_cache_stats(struct pthread_stack_cache_stats *stats, size_t size)
 {
-	assert(mutex && (!attr || IS_MAPPED(attr)));
-	// From PTHREAD_MUTEX_INIT(3)
-	// Attempting to initialize an already initialized mutex result in undefined behavior.
-	*mutex = (bionic_mutex_t){0};
-	mutex->glibc = mmap(NULL, sizeof(*mutex->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return pthread_mutex_init(mutex->glibc, (attr ? attr->glibc : NULL));
+	pthread_mutex_lock(&stack_cache.lock);
+	struct pthread_stack_cache_stats tmp = stack_cache.stats;
+	pthread_mutex_unlock(&stack_cache.lock);
+	memcpy(stats, &tmp, MIN(size, sizeof(tmp)));
 }
 
-int
-bionic_pthread_mutex_lock(bionic_mutex_t *mutex)
+__attribute__((constructor)) static void stack_cache_init(void)
 {
-	assert(mutex);
-	INIT_IF_NOT_MAPPED(mutex, default_pthread_mutex_init);
-	return pthread_mutex_lock(mutex->glibc);
+	const char *env = getenv("BIONIC_PTHREAD_STACK_CACHE");
+	if (!env)
+		return;
+
+	char *end;
+	unsigned long long size = strtoull(env, &end, 10);
+	switch (*end) {
+		case 'G': case 'g': size <<= 10; /* fallthrough */
+		case 'M': case 'm': size <<= 10; /* fallthrough */
+		case 'K': case 'k': size <<= 10;
+	}
+	stack_cache.max_bytes = size;
+	stack_cache.enabled = size > 0;
 }
 
-int bionic_pthread_mutex_trylock(bionic_mutex_t *mutex)
+int bionic_pthread_join(bionic_pthread_t thread, void **retval)
 {
-	assert(mutex);
-	INIT_IF_NOT_MAPPED(mutex, default_pthread_mutex_init);
-	return pthread_mutex_trylock(mutex->glibc);
+	int ret = pthread_join((pthread_t)thread, retval);
+	if (!ret && unlikely(stack_cache.enabled))
+		stack_cache_joined_or_detached((pthread_t)thread, true);
+	return ret;
 }
 
-int bionic_pthread_mutex_unlock(bionic_mutex_t *mutex)
+int bionic_pthread_detach(bionic_pthread_t thread)
 {
-	assert(mutex);
-	INIT_IF_NOT_MAPPED(mutex, default_pthread_mutex_init);
-	return pthread_mutex_unlock(mutex->glibc);
+	int ret = pthread_detach((pthread_t)thread);
+	if (!ret && unlikely(stack_cache.enabled))
+		stack_cache_joined_or_detached((pthread_t)thread, false);
+	return ret;
 }
 
-/* ---------------------------------------------------------------------------------------------- *
- * ---------------------------------------------------------------------------------------------- *
- * ---------------------------------------------------------------------------------------------- */
+/* Scheduling of the app's threads. Bionic applies the policy and priority of
+ * the attributes a thread is created with unless told to inherit them, and
+ * only warns when that's not allowed; glibc ignores them unless told not to
+ * inherit, and then fails pthread_create() when that's not allowed. So we
+ * apply them from the trampoline instead, and when a realtime policy is
+ * refused, the thread gets the highest nice priority we can give it (down to
+ * Android's urgent display one) instead.
+ *
+ * On top of that, threads can be placed with rules: `@thread <match>
+ * <setting>...` lines in cfg.d, or BIONIC_PTHREAD_THREAD_POLICY with the same
+ * rules separated by ';' (which take precedence), e.g.
+ *   @thread name:RenderThread cpus=4-7 nice=-4
+ *   @thread lib:libunity.so cgroup=/sys/fs/cgroup/game.slice/workers
+ * where <match> is a pattern (see fnmatch(3)) for one of:
+ *   sym:<pattern>   the symbol of the start routine, when the thread is created
+ *   lib:<pattern>   the library the start routine is in, likewise
+ *   name:<pattern>  the name given to the thread with pthread_setname_np()
+ *   nice:<n>        a nice priority of <n> or below asked for with setpriority(),
+ *                   which is how Android's thread priorities are set
+ * (a pattern on its own is matched against the symbol and the name), and the
+ * settings are:
+ *   policy=other|batch|idle|fifo|rr, priority=<n>  (the latter for fifo and rr)
+ *   nice=<n>
+ *   cpus=<list>     CPUs to run on, e.g. 0-3,8; sched_setaffinity() calls from
+ *                   the app for the thread are then kept within these
+ *   cgroup=<dir>    a (threaded, on cgroup v2) cgroup to move the thread into
+ * The first rule that matches wins; nice priorities we're not allowed to set
+ * are clamped to RLIMIT_NICE, for setpriority() only when a rule matches. */
+#define THREAD_POLICY_FALLBACK_NICE -8 // ANDROID_PRIORITY_URGENT_DISPLAY
+// how many threads without a record of ours (the main thread, the ones created
+// behind our back) we remember the rules of
+#define THREAD_POLICY_UNTRACKED 16
+
+enum thread_match {
+	MATCH_SYM = 1 << 0,
+	MATCH_LIB = 1 << 1,
+	MATCH_NAME = 1 << 2,
+	MATCH_NICE = 1 << 3,
+};
 
-/* condattr */
+struct thread_rule {
+	unsigned match;
+	char *pattern;
+	int nice_at_most;
+	int policy; // -1 to leave it alone
+	int priority;
+	bool has_nice;
+	int nice;
+	bool has_cpus;
+	cpu_set_t cpus;
+	char *cgroup;
+};
+
+static struct {
+	pthread_once_t once;
+	struct thread_rule *rules;
+	size_t nrules;
+} thread_policy = {
+	.once = PTHREAD_ONCE_INIT,
+};
+
+static bool parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+	while (*list) {
+		char *end;
+		unsigned long first = strtoul(list, &end, 10), last = first;
+		if (end == list)
+			return false;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if ((*end && *end != ',') || last < first || last >= CPU_SETSIZE)
+			return false;
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, cpus);
+		list = *end ? end + 1 : end;
+	}
+	return CPU_COUNT(cpus) > 0;
+}
+
+static bool parse_sched_policy(const char *name, int *policy)
+{
+	static const struct {
+		const char *name;
+		int policy;
+	} policies[] = {
+		{ "other", SCHED_OTHER },
+		{ "batch", SCHED_BATCH },
+		{ "idle", SCHED_IDLE },
+		{ "fifo", SCHED_FIFO },
+		{ "rr", SCHED_RR },
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(policies); i++) {
+		if (!strcmp(name, policies[i].name)) {
+			*policy = policies[i].policy;
+			return true;
+		}
+	}
+	return false;
+}
+
+// parses (and modifies) one rule, `<match> <setting>...`
+static void thread_policy_add_rule(char *rule)
+{
+	static const char delims[] = " \t\n";
+	struct thread_rule new = { .policy = -1 };
+	char *save, *token = strtok_r(rule, delims, &save);
+
+	if (!token)
+		return;
+	if (!strncmp(token, "sym:", 4)) {
+		new.match = MATCH_SYM;
+		token += 4;
+	} else if (!strncmp(token, "lib:", 4)) {
+		new.match = MATCH_LIB;
+		token += 4;
+	} else if (!strncmp(token, "name:", 5)) {
+		new.match = MATCH_NAME;
+		token += 5;
+	} else if (!strncmp(token, "nice:", 5)) {
+		new.match = MATCH_NICE;
+		new.nice_at_most = atoi(token + 5);
+	} else {
+		new.match = MATCH_SYM | MATCH_NAME;
+	}
+	new.pattern = strdup(token);
+
+	while ((token = strtok_r(NULL, delims, &save))) {
+		char *value = strchr(token, '=');
+		bool ok = value != NULL;
+		if (value) {
+			*value++ = '\0';
+			if (!strcmp(token, "policy"))
+				ok = parse_sched_policy(value, &new.policy);
+			else if (!strcmp(token, "priority"))
+				new.priority = atoi(value);
+			else if (!strcmp(token, "nice"))
+				new.nice = atoi(value), new.has_nice = true;
+			else if (!strcmp(token, "cpus"))
+				ok = new.has_cpus = parse_cpu_list(value, &new.cpus);
+			else if (!strcmp(token, "cgroup"))
+				new.cgroup = strdup(value);
+			else
+				ok = false;
+		}
+		if (!ok)
+			fprintf(stderr, "libpthread_bio: ignoring `%s` in thread policy rule for %s\n", token, new.pattern);
+	}
+
+	struct thread_rule *rules = realloc(thread_policy.rules, (thread_policy.nrules + 1) * sizeof(*rules));
+	if (!rules || !new.pattern) {
+		free(new.pattern);
+		free(new.cgroup);
+		return;
+	}
+	rules[thread_policy.nrules++] = new;
+	thread_policy.rules = rules;
+}
+
+static void thread_policy_load(void)
+{
+	const char *env = getenv("BIONIC_PTHREAD_THREAD_POLICY");
+	if (env) {
+		char *rules = strdup(env), *save;
+		for (char *rule = rules ? strtok_r(rules, ";", &save) : NULL; rule; rule = strtok_r(NULL, ";", &save))
+			thread_policy_add_rule(rule);
+		free(rules);
+	}
+
+	// the cfg.d directives are read by the linker
+	const char *(*cfg_directive)(const char *keyword, size_t *iter) = dlsym(RTLD_DEFAULT, "cfg_directive");
+	const char *directive;
+	size_t iter = 0;
+	while (cfg_directive && (directive = cfg_directive("thread", &iter))) {
+		char *rule = strdup(directive);
+		if (rule)
+			thread_policy_add_rule(rule);
+		free(rule);
+	}
+}
+
+static const struct thread_rule *thread_policy_match(unsigned match, const char *sym, const char *lib, const char *name, int nice)
+{
+	pthread_once(&thread_policy.once, thread_policy_load);
+
+	for (size_t i = 0; i < thread_policy.nrules; i++) {
+		const struct thread_rule *rule = &thread_policy.rules[i];
+		unsigned m = rule->match & match;
+		if ((m & MATCH_SYM && sym && !fnmatch(rule->pattern, sym, 0)) ||
+		    (m & MATCH_LIB && lib && !fnmatch(rule->pattern, lib, 0)) ||
+		    (m & MATCH_NAME && name && !fnmatch(rule->pattern, name, 0)) ||
+		    (m & MATCH_NICE && nice <= rule->nice_at_most))
+			return rule;
+	}
+	return NULL;
+}
+
+/* sets the nice priority of `tid`, or the closest one we're allowed to */
+static int set_nice(pid_t tid, int nice)
+{
+	if (!setpriority(PRIO_PROCESS, tid, nice))
+		return 0;
+
+	int err = errno;
+	struct rlimit limit;
+	errno = 0;
+	int current = getpriority(PRIO_PROCESS, tid);
+	if ((err != EACCES && err != EPERM) || errno || getrlimit(RLIMIT_NICE, &limit))
+		return (errno = err), -1;
+
+	// RLIMIT_NICE is 20 - the lowest nice value allowed
+	int lowest = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 40 ? -20 : 20 - (int)limit.rlim_cur;
+	lowest = MIN(lowest, current);
+	if (nice >= lowest)
+		return (errno = err), -1;
+	return setpriority(PRIO_PROCESS, tid, lowest);
+}
+
+static void set_sched(pid_t tid, int policy, int priority)
+{
+	struct sched_param param = { .sched_priority = priority };
+
+	if (!sched_setscheduler(tid, policy, &param))
+		return;
+	if (policy == SCHED_FIFO || policy == SCHED_RR)
+		set_nice(tid, THREAD_POLICY_FALLBACK_NICE);
+}
+
+static void cgroup_attach(pid_t tid, const char *cgroup)
+{
+	static const char *const files[] = { "cgroup.threads", "tasks" }; // v2, v1
+	char path[PATH_MAX], buf[16];
+	int len = snprintf(buf, sizeof(buf), "%d\n", tid);
+
+	for (size_t i = 0; i < ARRAY_SIZE(files); i++) {
+		snprintf(path, sizeof(path), "%s/%s", cgroup, files[i]);
+		int fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		bool ok = write(fd, buf, len) == len;
+		close(fd);
+		if (ok)
+			return;
+	}
+	fprintf(stderr, "libpthread_bio: couldn't move thread %d to cgroup %s: %s\n", tid, cgroup, strerror(errno));
+}
+
+static void thread_rule_apply(pid_t tid, const struct thread_rule *rule)
+{
+	if (rule->policy >= 0)
+		set_sched(tid, rule->policy, rule->priority);
+	if (rule->has_nice)
+		set_nice(tid, rule->nice);
+	if (rule->has_cpus)
+		sched_setaffinity(tid, sizeof(rule->cpus), &rule->cpus);
+	if (rule->cgroup)
+		cgroup_attach(tid, rule->cgroup);
+}
+
+// a copy of `attr` inheriting the scheduling, for bionic_pthread_create()
+static void attr_copy_inherit_sched(const pthread_attr_t *attr, pthread_attr_t *copy)
+{
+	size_t size;
+	void *addr;
+	int detachstate;
+
+	pthread_attr_init(copy);
+	if (!pthread_attr_getstack(attr, &addr, &size) && (uintptr_t)addr + size != 0)
+		pthread_attr_setstack(copy, addr, size);
+	else if (!pthread_attr_getstacksize(attr, &size))
+		pthread_attr_setstacksize(copy, size);
+	if (!pthread_attr_getguardsize(attr, &size))
+		pthread_attr_setguardsize(copy, size);
+	if (!pthread_attr_getdetachstate(attr, &detachstate))
+		pthread_attr_setdetachstate(copy, detachstate);
+}
+
+/* Threads created by the app start out in a trampoline of ours, which keeps a
+ * record of them until they exit: what they run, who created them and when,
+ * with which attributes, and their CPU clock, for pthread_get_thread_stats().
+ * The trampoline also names the thread after its start routine, so it can be
+ * told apart in /proc (and debuggers); the app can still rename it later. The
+ * name is looked up by the creating thread: a thread created by a constructor
+ * mustn't wait for the bionic linker, which is running the constructor.
+ *
+ * With BIONIC_PTHREAD_THREAD_DUMP set to a file name (or "-" for stderr), the
+ * table from pthread_dump_threads() is written there at exit, and also every
+ * BIONIC_PTHREAD_THREAD_DUMP_SECS seconds if that's set. */
+struct thread_record {
+	struct thread_record *next, **prev;
+	struct pthread_thread_stats stats;
+	void *arg;
+	pthread_t thread;
+	clockid_t cpu_clock;
+	bool started;
+	struct cached_stack *stack;
+	// the scheduling from the attributes, for the trampoline to apply
+	bool apply_sched;
+	// the thread policy rule applied to it, if any
+	const struct thread_rule *rule;
+	// the name from the start routine, for the trampoline to set
+	char comm[16]; // the most the kernel keeps
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_key_t key;
+	struct thread_record *threads;
+	size_t count;
+	// what's left of the ones that have exited
+	size_t exited;
+	struct timespec exited_cpu_time;
+	const char *dump_path;
+	// the rules applied to threads without a record, oldest overwritten first
+	struct {
+		pid_t tid;
+		const struct thread_rule *rule;
+	} untracked[THREAD_POLICY_UNTRACKED];
+	size_t untracked_next;
+} thread_registry = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void thread_registry_exit(void *data)
+{
+	struct thread_record *record = data;
+	struct timespec cpu_time;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+
+	pthread_mutex_lock(&thread_registry.lock);
+	*record->prev = record->next;
+	if (record->next)
+		record->next->prev = record->prev;
+	thread_registry.count--;
+	thread_registry.exited++;
+	timespec_add(&thread_registry.exited_cpu_time, &cpu_time);
+	pthread_mutex_unlock(&thread_registry.lock);
+
+	free(record);
+}
+
+static void *thread_trampoline(void *data)
+{
+	struct thread_record *record = data;
+	void *(*start)(void *) = record->stats.start_routine;
+	void *arg = record->arg;
+
+	pthread_setspecific(thread_registry.key, record);
+	if (record->stack)
+		stack_cache_started(record->stack);
+
+	pthread_mutex_lock(&thread_registry.lock);
+	record->stats.tid = syscall(__NR_gettid);
+	record->thread = pthread_self();
+	record->started = !pthread_getcpuclockid(record->thread, &record->cpu_clock);
+	pthread_mutex_unlock(&thread_registry.lock);
+
+	if (record->comm[0])
+		pthread_setname_np(record->thread, record->comm);
+	if (record->apply_sched)
+		set_sched(record->stats.tid, record->stats.sched_policy, record->stats.sched_priority);
+	if (record->rule)
+		thread_rule_apply(record->stats.tid, record->rule);
+
+	return start(arg);
+}
+
+// names the thread after its start routine, and finds the first sym/lib rule
+// matching that, before it's started
+static void thread_identify(struct thread_record *record)
+{
+	Dl_info info;
+
+	if (!try_symbolize(record->stats.start_routine, &info))
+		return;
+
+	const char *sym = info.dli_sname;
+	const char *lib = strrchr(info.dli_fname, '/');
+	lib = lib ? lib + 1 : info.dli_fname;
+	snprintf(record->comm, sizeof(record->comm), "%s", sym ?: lib);
+	record->rule = thread_policy_match(MATCH_SYM | MATCH_LIB, sym, lib, NULL, 0);
+}
+
+int bionic_pthread_create(bionic_pthread_t *thread, const bionic_attr_t *attr, void* (*start)(void*), void *arg)
+{
+	assert(thread && (!attr || IS_INITIALIZED(attr)));
+
+	struct thread_record *record = calloc(1, sizeof(*record));
+	if (!record)
+		return pthread_create((pthread_t*)thread, (attr ? GLIBC(attr) : NULL), start, arg);
+
+	record->stats.start_routine = start;
+	record->arg = arg;
+	record->stats.parent = syscall(__NR_gettid);
+	clock_gettime(CLOCK_REALTIME, &record->stats.created);
+	int inheritsched = PTHREAD_INHERIT_SCHED;
+	if (attr) {
+		struct sched_param param;
+		pthread_attr_getstacksize(GLIBC(attr), &record->stats.stack_size);
+		pthread_attr_getdetachstate(GLIBC(attr), &record->stats.detached);
+		pthread_attr_getschedpolicy(GLIBC(attr), &record->stats.sched_policy);
+		if (!pthread_attr_getschedparam(GLIBC(attr), &param))
+			record->stats.sched_priority = param.sched_priority;
+		record->stats.detached = record->stats.detached == PTHREAD_CREATE_DETACHED;
+		pthread_attr_getinheritsched(GLIBC(attr), &inheritsched);
+		record->apply_sched = inheritsched == PTHREAD_INHERIT_SCHED &&
+		                      (record->stats.sched_policy != SCHED_OTHER || record->stats.sched_priority);
+	}
+	thread_identify(record);
+
+	pthread_mutex_lock(&thread_registry.lock);
+	record->next = thread_registry.threads;
+	record->prev = &thread_registry.threads;
+	if (record->next)
+		record->next->prev = &record->next;
+	thread_registry.threads = record;
+	thread_registry.count++;
+	pthread_mutex_unlock(&thread_registry.lock);
+
+	// a detached thread may be gone (and its record with it) by the time
+	// pthread_create() returns
+	const pthread_attr_t *host_attr = attr ? GLIBC(attr) : NULL;
+	pthread_attr_t stack_attr;
+	struct cached_stack *stack = NULL;
+	if (unlikely(stack_cache.enabled) && (stack = stack_cache_get(host_attr, &stack_attr)))
+		host_attr = &stack_attr;
+	record->stack = stack;
+
+	int ret = pthread_create((pthread_t*)thread, host_attr, thread_trampoline, record);
+	if (ret == EPERM && inheritsched == PTHREAD_EXPLICIT_SCHED) {
+		// not allowed to use that scheduling, which bionic only warns about
+		pthread_attr_t inherit_attr;
+		attr_copy_inherit_sched(host_attr, &inherit_attr);
+		record->apply_sched = true;
+		ret = pthread_create((pthread_t*)thread, &inherit_attr, thread_trampoline, record);
+		pthread_attr_destroy(&inherit_attr);
+	}
+	if (stack) {
+		pthread_attr_destroy(&stack_attr);
+		stack_cache_put(stack, ret ? NULL : (pthread_t*)thread);
+	}
+	if (ret) {
+		pthread_mutex_lock(&thread_registry.lock);
+		*record->prev = record->next;
+		if (record->next)
+			record->next->prev = record->prev;
+		thread_registry.count--;
+		pthread_mutex_unlock(&thread_registry.lock);
+		free(record);
+	}
+	return ret;
+}
+
+size_t pthread_get_thread_stats(struct pthread_thread_stats *stats, size_t size, size_t count)
+{
+	size_t i = 0;
+
+	// a thread only leaves the registry with the lock held, so the
+	// clocks of the ones in there are still valid
+	pthread_mutex_lock(&thread_registry.lock);
+	for (struct thread_record *record = thread_registry.threads; record && i < count; record = record->next, i++) {
+		struct pthread_thread_stats tmp = record->stats;
+		if (record->started)
+			clock_gettime(record->cpu_clock, &tmp.cpu_time);
+		memcpy((char *)stats + i * size, &tmp, MIN(size, sizeof(tmp)));
+	}
+	size_t ret = thread_registry.count;
+	pthread_mutex_unlock(&thread_registry.lock);
+
+	return ret;
+}
+
+static void dump_threads(FILE *out)
+{
+	struct timespec now;
+	struct {
+		struct pthread_thread_stats stats;
+		struct timespec cpu_time;
+		char name[16];
+	} *threads;
+	size_t count = 0;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	// copied out with the lock held and symbolized without it, since the
+	// bionic linker may be running a constructor that's creating a thread
+	pthread_mutex_lock(&thread_registry.lock);
+	threads = calloc(thread_registry.count + 1, sizeof(*threads));
+	for (struct thread_record *record = thread_registry.threads; record && threads; record = record->next, count++) {
+		threads[count].stats = record->stats;
+		if (record->started) {
+			clock_gettime(record->cpu_clock, &threads[count].cpu_time);
+			pthread_getname_np(record->thread, threads[count].name, sizeof(threads[count].name));
+		}
+	}
+	size_t exited = thread_registry.exited;
+	struct timespec exited_cpu_time = thread_registry.exited_cpu_time;
+	pthread_mutex_unlock(&thread_registry.lock);
+
+	fprintf(out, "# tid\tparent\tname\tcpu_ms\tage_s\tstack_size\tdetached\tpolicy\tpriority\tstart\n");
+	for (size_t i = 0; i < count; i++) {
+		const struct pthread_thread_stats *stats = &threads[i].stats;
+		const struct timespec *cpu_time = &threads[i].cpu_time;
+
+		fprintf(out, "%d\t%d\t%s\t%.1f\t%.1f\t%zu\t%d\t%d\t%d", stats->tid, stats->parent, threads[i].name,
+		        cpu_time->tv_sec * 1e3 + cpu_time->tv_nsec / 1e6,
+		        (now.tv_sec - stats->created.tv_sec) + (now.tv_nsec - stats->created.tv_nsec) / 1e9,
+		        stats->stack_size, stats->detached, stats->sched_policy, stats->sched_priority);
+		print_symbolized(out, stats->start_routine);
+		fputc('\n', out);
+	}
+	fprintf(out, "# %zu exited threads, %.1f ms of CPU time\n", exited,
+	        exited_cpu_time.tv_sec * 1e3 + exited_cpu_time.tv_nsec / 1e6);
+	free(threads);
+}
+
+void pthread_dump_threads(int fd)
+{
+	int copy = dup(fd);
+	FILE *out = copy >= 0 ? fdopen(copy, "w") : NULL;
+	if (!out) {
+		if (copy >= 0)
+			close(copy);
+		return;
+	}
+	dump_threads(out);
+	fclose(out);
+}
+
+static void thread_registry_dump(void)
+{
+	FILE *out = strcmp(thread_registry.dump_path, "-") ? fopen(thread_registry.dump_path, "w") : stderr;
+	if (!out)
+		return;
+	dump_threads(out);
+	if (out != stderr)
+		fclose(out);
+	else
+		fflush(out);
+}
+
+static void *thread_registry_dumper(void *data)
+{
+	unsigned int secs = (uintptr_t)data;
+
+	for (;;) {
+		sleep(secs);
+		thread_registry_dump();
+	}
+	return NULL;
+}
+
+__attribute__((constructor)) static void thread_registry_init(void)
+{
+	pthread_key_create(&thread_registry.key, thread_registry_exit);
+
+	thread_registry.dump_path = getenv("BIONIC_PTHREAD_THREAD_DUMP");
+	if (!thread_registry.dump_path || !*thread_registry.dump_path)
+		return;
+	atexit(thread_registry_dump);
+
+	const char *secs = getenv("BIONIC_PTHREAD_THREAD_DUMP_SECS");
+	unsigned long interval = secs ? strtoul(secs, NULL, 10) : 0;
+	pthread_t dumper;
+	if (interval && !pthread_create(&dumper, NULL, thread_registry_dumper, (void *)(uintptr_t)interval))
+		pthread_detach(dumper);
+}
+
+// with the registry lock held; a tid of 0 is the calling thread
+static struct thread_record *thread_registry_find_locked(pid_t tid)
+{
+	if (!tid)
+		return pthread_getspecific(thread_registry.key);
+	for (struct thread_record *record = thread_registry.threads; record; record = record->next) {
+		if (record->stats.tid == tid)
+			return record;
+	}
+	return NULL;
+}
+
+// with the registry lock held: where the rule applied to `tid` (0 for the
+// calling thread) is kept, NULL if it has none and `add` is false
+static const struct thread_rule **thread_rule_slot_locked(pid_t tid, bool add)
+{
+	struct thread_record *record = thread_registry_find_locked(tid);
+	if (record)
+		return &record->rule;
+
+	if (!tid)
+		tid = syscall(__NR_gettid);
+	for (size_t i = 0; i < THREAD_POLICY_UNTRACKED; i++) {
+		if (thread_registry.untracked[i].tid == tid)
+			return &thread_registry.untracked[i].rule;
+	}
+	if (!add)
+		return NULL;
+
+	size_t i = thread_registry.untracked_next++ % THREAD_POLICY_UNTRACKED;
+	thread_registry.untracked[i].tid = tid;
+	return &thread_registry.untracked[i].rule;
+}
+
+/* the wrappers for the thread policy rules matching names and priorities, and
+ * keeping the app's affinities within the rules' CPUs (see above) */
+
+int bionic_pthread_setname_np(bionic_pthread_t thread, const char *name)
+{
+	int ret = pthread_setname_np((pthread_t)thread, name);
+	if (ret)
+		return ret;
+
+	const struct thread_rule *rule = thread_policy_match(MATCH_NAME, NULL, NULL, name, 0);
+	if (!rule)
+		return 0;
+
+	pid_t tid = 0;
+	pthread_mutex_lock(&thread_registry.lock);
+	const struct thread_rule **slot = NULL;
+	if (pthread_equal((pthread_t)thread, pthread_self())) {
+		tid = syscall(__NR_gettid);
+		slot = thread_rule_slot_locked(tid, true);
+	} else {
+		// we only know the tids of the others we have a record of
+		for (struct thread_record *record = thread_registry.threads; record; record = record->next) {
+			if (record->stats.tid && pthread_equal(record->thread, (pthread_t)thread)) {
+				tid = record->stats.tid;
+				slot = &record->rule;
+				break;
+			}
+		}
+	}
+	if (slot)
+		*slot = rule;
+	pthread_mutex_unlock(&thread_registry.lock);
+
+	if (tid)
+		thread_rule_apply(tid, rule);
+	return 0;
+}
+
+int bionic_setpriority(int which, id_t who, int prio)
+{
+	if (which != PRIO_PROCESS)
+		return setpriority(which, who, prio);
+
+	const struct thread_rule *rule = thread_policy_match(MATCH_NICE, NULL, NULL, NULL, prio);
+	if (!rule)
+		return setpriority(which, who, prio);
+
+	int ret = set_nice(who, prio);
+	pid_t tid = who ? (pid_t)who : syscall(__NR_gettid);
+	pthread_mutex_lock(&thread_registry.lock);
+	*thread_rule_slot_locked(tid, true) = rule;
+	pthread_mutex_unlock(&thread_registry.lock);
+	thread_rule_apply(tid, rule);
+	return ret;
+}
+
+int bionic_sched_setaffinity(pid_t pid, size_t size, const cpu_set_t *mask)
+{
+	const struct thread_rule *rule = NULL;
+
+	pthread_mutex_lock(&thread_registry.lock);
+	const struct thread_rule **slot = thread_rule_slot_locked(pid, false);
+	if (slot)
+		rule = *slot;
+	pthread_mutex_unlock(&thread_registry.lock);
+
+	if (!rule || !rule->has_cpus)
+		return sched_setaffinity(pid, size, mask);
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	memcpy(&cpus, mask, MIN(size, sizeof(cpus)));
+	CPU_AND(&cpus, &cpus, &rule->cpus);
+	return sched_setaffinity(pid, sizeof(cpus), CPU_COUNT(&cpus) ? &cpus : &rule->cpus);
+}
+
+/* ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- */
+
+/* mutexattr */
+
+int bionic_pthread_mutexattr_settype(bionic_mutexattr_t *attr, int type)
+{
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_mutexattr_settype(GLIBC(attr), type);
+}
+
+int bionic_pthread_mutexattr_destroy(bionic_mutexattr_t *attr)
+{
+	assert(attr);
+	int ret = 0;
+	if (IS_INITIALIZED(attr)) {
+		ret = pthread_mutexattr_destroy(GLIBC(attr));
+		slab_free(GLIBC(attr));
+		attr->glibc = NULL;
+	}
+	return ret;
+}
+
+int bionic_pthread_mutexattr_init(bionic_mutexattr_t *attr)
+{
+	assert(attr);
+	// From PTHREAD_MUTEXATTR_INIT(3)
+	// The results of initializing an already initialized mutex attributes object are undefined.
+	*attr = (bionic_mutexattr_t){0};
+	void *glibc = slab_alloc();
+	if (!glibc)
+		return ENOMEM;
+	SET_GLIBC(attr, glibc);
+	return pthread_mutexattr_init(GLIBC(attr));
+}
+
+/* ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- */
+
+/* mutex */
+
+#ifdef NATIVE_MUTEX
+/* Bionic's 32-bit mutex is a single word:
+ *  bits  0-1   state: unlocked, locked, or locked with (maybe) waiters
+ *  bits  2-12  recursion counter (recursive mutexes only)
+ *  bit   13    process-shared
+ *  bits 14-15  type, as in the static initializers
+ *  bits 16-31  owner's tid (recursive and errorcheck mutexes only)
+ * A normal private mutex is just the state, so taking or releasing it when
+ * uncontended is a single CAS, and the static initializers need nothing done. */
+#define MUTEX_STATE_MASK 3
+#define MUTEX_STATE_UNLOCKED 0
+#define MUTEX_STATE_LOCKED_UNCONTENDED 1
+#define MUTEX_STATE_LOCKED_CONTENDED 2
+#define MUTEX_COUNTER_STEP (1 << 2)
+#define MUTEX_COUNTER_MASK (0x7ff << 2)
+#define MUTEX_SHARED_MASK (1 << 13)
+#define MUTEX_TYPE(x) (((x) & BIONIC_MUTEX_TYPE_MASK) >> 14)
+#define MUTEX_OWNER_SHIFT 16
+
+_Static_assert(PTHREAD_MUTEX_NORMAL == 0 && PTHREAD_MUTEX_RECURSIVE == 1 && PTHREAD_MUTEX_ERRORCHECK == 2, "mutex types don't match bionic's");
+
+static __thread pid_t self_tid;
+
+static void reset_self_tid(void)
+{
+	self_tid = 0;
+}
+
+static void register_reset_self_tid(void)
+{
+	pthread_atfork(NULL, NULL, reset_self_tid);
+}
+
+static pid_t get_self_tid(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	if (unlikely(!self_tid)) {
+		pthread_once(&once, register_reset_self_tid);
+		self_tid = syscall(__NR_gettid);
+	}
+	return self_tid;
+}
+
+/* Only 16 bits of the owner's tid fit in the mutex, and the host's tids can be
+ * bigger than that, so a match is checked against the recursive and errorcheck
+ * mutexes this thread holds. If it holds too many of them to keep track, the
+ * 16 bits have to do. */
+#define MUTEX_HELD_MAX 32
+
+static __thread struct {
+	bionic_mutex_t *mutex[MUTEX_HELD_MAX];
+	size_t count;
+	size_t untracked;
+} held_mutexes;
+
+static void mutex_held_add(bionic_mutex_t *mutex)
+{
+	if (held_mutexes.count < MUTEX_HELD_MAX)
+		held_mutexes.mutex[held_mutexes.count++] = mutex;
+	else
+		held_mutexes.untracked++;
+}
+
+static void mutex_held_remove(bionic_mutex_t *mutex)
+{
+	for (size_t i = held_mutexes.count; i-- > 0;) {
+		if (held_mutexes.mutex[i] == mutex) {
+			held_mutexes.mutex[i] = held_mutexes.mutex[--held_mutexes.count];
+			return;
+		}
+	}
+	if (held_mutexes.untracked)
+		held_mutexes.untracked--;
+}
+
+static bool mutex_owned(bionic_mutex_t *mutex, int32_t mvalue)
+{
+	if ((mvalue & MUTEX_STATE_MASK) == MUTEX_STATE_UNLOCKED)
+		return false;
+	if (((uint32_t)mvalue >> MUTEX_OWNER_SHIFT) != ((uint32_t)get_self_tid() & 0xffff))
+		return false;
+	for (size_t i = 0; i < held_mutexes.count; i++) {
+		if (held_mutexes.mutex[i] == mutex)
+			return true;
+	}
+	return held_mutexes.untracked;
+}
+
+static int native_mutex_lock(bionic_mutex_t *mutex, int32_t mvalue, bool try)
+{
+	int32_t *word = &mutex->__private[0];
+	const bool shared = mvalue & MUTEX_SHARED_MASK;
+	const int type = MUTEX_TYPE(mvalue);
+	const int32_t unlocked = mvalue & (MUTEX_SHARED_MASK | BIONIC_MUTEX_TYPE_MASK);
+
+	if (type == PTHREAD_MUTEX_NORMAL) {
+		const int32_t contended = unlocked | MUTEX_STATE_LOCKED_CONTENDED;
+
+		if (mvalue == unlocked && __atomic_compare_exchange_n(word, &mvalue, unlocked | MUTEX_STATE_LOCKED_UNCONTENDED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 0;
+		if (try)
+			return EBUSY;
+		while (__atomic_exchange_n(word, contended, __ATOMIC_ACQUIRE) != unlocked)
+			__futex_wait_ex(word, shared, contended);
+		return 0;
+	}
+
+	if (mutex_owned(mutex, mvalue)) {
+		if (type == PTHREAD_MUTEX_ERRORCHECK)
+			return try ? EBUSY : EDEADLK;
+		if ((mvalue & MUTEX_COUNTER_MASK) == MUTEX_COUNTER_MASK)
+			return EAGAIN;
+		__atomic_fetch_add(word, MUTEX_COUNTER_STEP, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	const int32_t owner = (int32_t)((uint32_t)get_self_tid() << MUTEX_OWNER_SHIFT);
+
+	if ((mvalue & MUTEX_STATE_MASK) == MUTEX_STATE_UNLOCKED && __atomic_compare_exchange_n(word, &mvalue, unlocked | owner | MUTEX_STATE_LOCKED_UNCONTENDED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		mutex_held_add(mutex);
+		return 0;
+	}
+	if (try)
+		return EBUSY;
+
+	// once we've waited, there may be others waiting too, so we leave the
+	// mutex marked contended to have the unlock wake them
+	for (;;) {
+		mvalue = __atomic_load_n(word, __ATOMIC_RELAXED);
+		if ((mvalue & MUTEX_STATE_MASK) == MUTEX_STATE_UNLOCKED) {
+			if (__atomic_compare_exchange_n(word, &mvalue, unlocked | owner | MUTEX_STATE_LOCKED_CONTENDED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				break;
+			continue;
+		}
+		if ((mvalue & MUTEX_STATE_MASK) == MUTEX_STATE_LOCKED_UNCONTENDED) {
+			int32_t contended = (mvalue & ~MUTEX_STATE_MASK) | MUTEX_STATE_LOCKED_CONTENDED;
+			if (!__atomic_compare_exchange_n(word, &mvalue, contended, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				continue;
+			mvalue = contended;
+		}
+		__futex_wait_ex(word, shared, mvalue);
+	}
+	mutex_held_add(mutex);
+	return 0;
+}
+
+int bionic_pthread_mutex_destroy(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+	int32_t mvalue = __atomic_load_n(&mutex->__private[0], __ATOMIC_RELAXED);
+	return (mvalue & MUTEX_STATE_MASK) == MUTEX_STATE_UNLOCKED ? 0 : EBUSY;
+}
+
+int bionic_pthread_mutex_init(bionic_mutex_t *mutex, const bionic_mutexattr_t *attr)
+{
+	assert(mutex && (!attr || IS_INITIALIZED(attr)));
+	int type = PTHREAD_MUTEX_NORMAL, pshared = PTHREAD_PROCESS_PRIVATE;
+	if (attr) {
+		pthread_mutexattr_gettype(GLIBC(attr), &type);
+		pthread_mutexattr_getpshared(GLIBC(attr), &pshared);
+	}
+	if (type < PTHREAD_MUTEX_NORMAL || type > PTHREAD_MUTEX_ERRORCHECK)
+		return EINVAL;
+
+	*mutex = (bionic_mutex_t){0};
+	mutex->__private[0] = (type << 14) | (pshared == PTHREAD_PROCESS_SHARED ? MUTEX_SHARED_MASK : 0);
+	return 0;
+}
+
+static pid_t mutex_holder(bionic_mutex_t *mutex)
+{
+	// only 16 bits of it, and only for recursive and errorcheck mutexes
+	return (uint32_t)__atomic_load_n(&mutex->__private[0], __ATOMIC_RELAXED) >> MUTEX_OWNER_SHIFT;
+}
+
+static inline int mutex_lock(bionic_mutex_t *mutex)
+{
+	int32_t mvalue = MUTEX_STATE_UNLOCKED;
+	if (__atomic_compare_exchange_n(&mutex->__private[0], &mvalue, MUTEX_STATE_LOCKED_UNCONTENDED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	return native_mutex_lock(mutex, mvalue, false);
+}
+
+int bionic_pthread_mutex_trylock(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+	int32_t mvalue = MUTEX_STATE_UNLOCKED;
+	if (__atomic_compare_exchange_n(&mutex->__private[0], &mvalue, MUTEX_STATE_LOCKED_UNCONTENDED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	return native_mutex_lock(mutex, mvalue, true);
+}
+
+int bionic_pthread_mutex_unlock(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+	int32_t *word = &mutex->__private[0];
+	int32_t mvalue = MUTEX_STATE_LOCKED_UNCONTENDED;
+	if (__atomic_compare_exchange_n(word, &mvalue, MUTEX_STATE_UNLOCKED, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return 0;
+
+	const bool shared = mvalue & MUTEX_SHARED_MASK;
+	const int32_t unlocked = mvalue & (MUTEX_SHARED_MASK | BIONIC_MUTEX_TYPE_MASK);
+
+	if (MUTEX_TYPE(mvalue) != PTHREAD_MUTEX_NORMAL) {
+		if (!mutex_owned(mutex, mvalue))
+			return EPERM;
+		if (mvalue & MUTEX_COUNTER_MASK) {
+			__atomic_fetch_sub(word, MUTEX_COUNTER_STEP, __ATOMIC_RELAXED);
+			return 0;
+		}
+		mutex_held_remove(mutex);
+	}
+
+	if ((__atomic_exchange_n(word, unlocked, __ATOMIC_RELEASE) & MUTEX_STATE_MASK) == MUTEX_STATE_LOCKED_CONTENDED)
+		__futex_wake_ex(word, shared, 1);
+	return 0;
+}
+#else
+#ifdef EMBEDDED_MUTEX
+static void translate_mutex_initializer(bionic_mutex_t *mutex, int32_t word)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(bionic_mutex_init_map); i++) {
+		if (bionic_mutex_init_map[i].bionic.__private[0] != word)
+			continue;
+
+		// only the type differs, and it's the same for everyone getting here
+		// at the same time; the rest is still zero (or already in use)
+		((pthread_mutex_t *)mutex)->__data.__kind = bionic_mutex_init_map[i].glibc.__data.__kind;
+		__atomic_compare_exchange_n(&mutex->__private[0], &word, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+		return;
+	}
+
+	assert(0 && "no such default initializer???");
+}
+#else
+static void default_pthread_mutex_init(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+	// the initializers only differ in the first word (the rest is zeroes), and
+	// that's the only one we can load in one go if the mutex is misaligned
+	const uint32_t initializer = __atomic_load_n(&mutex->__private[0], __ATOMIC_ACQUIRE);
+
+	for (size_t i = 0; i < ARRAY_SIZE(bionic_mutex_init_map); i++) {
+		if ((uint32_t)bionic_mutex_init_map[i].bionic.__private[0] != initializer)
+			continue;
+
+		pthread_mutex_t *glibc = slab_alloc();
+		if (!glibc)
+			return;
+		memcpy(glibc, &bionic_mutex_init_map[i].glibc, sizeof(bionic_mutex_init_map[i].glibc));
+		PUBLISH_GLIBC(mutex, initializer, glibc);
+		return;
+	}
+
+	// someone else might have been quicker
+	assert(IS_INITIALIZED(mutex) && "no such default initializer???");
+}
+#endif
+
+static inline pthread_mutex_t *glibc_mutex(bionic_mutex_t *mutex)
+{
+#ifdef EMBEDDED_MUTEX
+	int32_t word = __atomic_load_n(&mutex->__private[0], __ATOMIC_ACQUIRE);
+	if (unlikely(word & BIONIC_MUTEX_TYPE_MASK))
+		translate_mutex_initializer(mutex, word);
+	return (pthread_mutex_t *)mutex;
+#else
+	return INIT_IF_NOT_INITIALIZED(mutex, default_pthread_mutex_init) ? GLIBC(mutex) : NULL;
+#endif
+}
+
+static pid_t mutex_holder(bionic_mutex_t *mutex)
+{
+#ifdef __GLIBC__
+	pthread_mutex_t *glibc = glibc_mutex(mutex);
+	return glibc ? __atomic_load_n(&glibc->__data.__owner, __ATOMIC_RELAXED) : 0;
+#else
+	return 0;
+#endif
+}
+
+int bionic_pthread_mutex_destroy(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+#ifdef EMBEDDED_MUTEX
+	return pthread_mutex_destroy(glibc_mutex(mutex));
+#else
+	int ret = 0;
+	if (IS_INITIALIZED(mutex)) {
+		ret = pthread_mutex_destroy(GLIBC(mutex));
+		slab_free(GLIBC(mutex));
+		mutex->glibc = NULL;
+	}
+	return ret;
+#endif
+}
+
+int bionic_pthread_mutex_init(bionic_mutex_t *mutex, const bionic_mutexattr_t *attr)
+{
+	assert(mutex && (!attr || IS_INITIALIZED(attr)));
+	// From PTHREAD_MUTEX_INIT(3)
+	// Attempting to initialize an already initialized mutex result in undefined behavior.
+	*mutex = (bionic_mutex_t){0};
+#ifndef EMBEDDED_MUTEX
+	pthread_mutex_t *glibc = slab_alloc();
+	if (!glibc)
+		return ENOMEM;
+	SET_GLIBC(mutex, glibc);
+#endif
+	return pthread_mutex_init(glibc_mutex(mutex), (attr ? GLIBC(attr) : NULL));
+}
+
+// With embedded mutexes, we try to take the lock before looking for a bionic
+// initializer: loading the lock word right before the atomic operation on it
+// costs more than the latter, and an initializer that hasn't been translated
+// yet just makes glibc report the mutex as busy.
+
+static inline int
+mutex_lock(bionic_mutex_t *mutex)
+{
+#ifdef EMBEDDED_MUTEX
+	if (!pthread_mutex_trylock((pthread_mutex_t *)mutex))
+		return 0;
+#endif
+	pthread_mutex_t *glibc = glibc_mutex(mutex);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_mutex_lock(glibc);
+}
+
+int bionic_pthread_mutex_trylock(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+#ifdef EMBEDDED_MUTEX
+	int ret = pthread_mutex_trylock((pthread_mutex_t *)mutex);
+	if (ret != EBUSY)
+		return ret;
+#endif
+	pthread_mutex_t *glibc = glibc_mutex(mutex);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_mutex_trylock(glibc);
+}
+
+int bionic_pthread_mutex_unlock(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+#ifdef EMBEDDED_MUTEX
+	// a mutex that has been locked has been translated already, so one with
+	// the bionic type still in there can't be held by anyone; glibc would
+	// take it for a normal one, and clear the type along with the lock
+	if (unlikely(__atomic_load_n(&mutex->__private[0], __ATOMIC_RELAXED) & BIONIC_MUTEX_TYPE_MASK))
+		return EPERM;
+	return pthread_mutex_unlock((pthread_mutex_t *)mutex);
+#else
+	pthread_mutex_t *glibc = glibc_mutex(mutex);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_mutex_unlock(glibc);
+#endif
+}
+#endif
+
+static int __attribute__((noinline)) profiled_mutex_lock(bionic_mutex_t *mutex, const void *caller)
+{
+	if (!bionic_pthread_mutex_trylock(mutex))
+		return 0;
+
+	pid_t holder = mutex_holder(mutex);
+	uint64_t start = lock_profile_now();
+	int ret = mutex_lock(mutex);
+	if (!ret)
+		lock_profile_record(LOCK_PROFILE_MUTEX, mutex, caller, holder, start);
+	return ret;
+}
+
+int bionic_pthread_mutex_lock(bionic_mutex_t *mutex)
+{
+	assert(mutex);
+	if (unlikely(lock_profile.enabled))
+		return profiled_mutex_lock(mutex, __builtin_return_address(0));
+	return mutex_lock(mutex);
+}
+
+
+/* ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- *
+ * ---------------------------------------------------------------------------------------------- */
+
+/* condattr */
 
 int bionic_pthread_condattr_destroy(bionic_condattr_t *attr)
 {
 	assert(attr);
 	int ret = 0;
-	if (IS_MAPPED(attr)) {
-		ret = pthread_condattr_destroy(attr->glibc);
-		munmap(attr->glibc, sizeof(*attr->glibc));
+	if (IS_INITIALIZED(attr)) {
+		ret = pthread_condattr_destroy(GLIBC(attr));
+		slab_free(GLIBC(attr));
+		attr->glibc = NULL;
 	}
 	return ret;
 }
@@ -520,14 +2368,17 @@ int bionic_pthread_condattr_destroy(bionic_condattr_t *attr)
 int bionic_pthread_condattr_init(bionic_condattr_t *attr)
 {
 	*attr = (bionic_condattr_t){0};
-	attr->glibc = mmap(NULL, sizeof(*attr->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return pthread_condattr_init(attr->glibc);
+	void *glibc = slab_alloc();
+	if (!glibc)
+		return ENOMEM;
+	SET_GLIBC(attr, glibc);
+	return pthread_condattr_init(GLIBC(attr));
 }
 
 int bionic_pthread_condattr_setclock(bionic_condattr_t *attr, clockid_t clock_id)
 {
-	assert(attr && IS_MAPPED(attr));
-	return pthread_condattr_setclock(attr->glibc, clock_id);
+	assert(attr && IS_INITIALIZED(attr));
+	return pthread_condattr_setclock(GLIBC(attr), clock_id);
 }
 
 /* ---------------------------------------------------------------------------------------------- *
@@ -536,90 +2387,221 @@ int bionic_pthread_condattr_setclock(bionic_condattr_t *attr, clockid_t clock_id
 
 /* cond */
 
+#ifdef NATIVE_COND
+/* Bionic's 32-bit cond is a single word as well: whether it's process-shared,
+ * whether its timeouts are on CLOCK_MONOTONIC rather than CLOCK_REALTIME, and
+ * a counter bumped by every signal, which the waiters sleep on. The futex wait
+ * takes an absolute timeout on either clock, so nothing has to be converted. */
+#define COND_SHARED_MASK 0x1
+#define COND_CLOCK_MONOTONIC_MASK 0x2
+#define COND_COUNTER_STEP 0x4
+
+static int native_cond_wait(bionic_cond_t *cond, bionic_mutex_t *mutex, bool use_realtime_clock, const struct timespec *abstime)
+{
+	int32_t *word = &cond->__private[0];
+
+	if (abstime && (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000))
+		return EINVAL;
+	if (abstime && abstime->tv_sec < 0)
+		return ETIMEDOUT;
+
+	int32_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+	bionic_pthread_mutex_unlock(mutex);
+	int ret = __futex_wait_abs_ex(word, old & COND_SHARED_MASK, old, use_realtime_clock, abstime);
+	bionic_pthread_mutex_lock(mutex);
+	return ret == -ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+static void native_cond_wake(bionic_cond_t *cond, int count)
+{
+	int32_t *word = &cond->__private[0];
+	int32_t old = __atomic_fetch_add(word, COND_COUNTER_STEP, __ATOMIC_RELEASE);
+	__futex_wake_ex(word, old & COND_SHARED_MASK, count);
+}
+
+int bionic_pthread_cond_destroy(bionic_cond_t *cond)
+{
+	assert(cond);
+	return 0;
+}
+
+int bionic_pthread_cond_init(bionic_cond_t *cond, const bionic_condattr_t *attr)
+{
+	int pshared = PTHREAD_PROCESS_PRIVATE;
+	clockid_t clock = CLOCK_REALTIME;
+	if (attr && IS_INITIALIZED(attr)) {
+		pthread_condattr_getpshared(GLIBC(attr), &pshared);
+		pthread_condattr_getclock(GLIBC(attr), &clock);
+	}
+
+	*cond = (bionic_cond_t){0};
+	cond->__private[0] = (pshared == PTHREAD_PROCESS_SHARED ? COND_SHARED_MASK : 0) |
+	                     (clock == CLOCK_MONOTONIC ? COND_CLOCK_MONOTONIC_MASK : 0);
+	return 0;
+}
+
+int bionic_pthread_cond_broadcast(bionic_cond_t *cond)
+{
+	assert(cond);
+	native_cond_wake(cond, INT32_MAX);
+	return 0;
+}
+
+int bionic_pthread_cond_signal(bionic_cond_t *cond)
+{
+	assert(cond);
+	native_cond_wake(cond, 1);
+	return 0;
+}
+
+static int cond_wait(bionic_cond_t *cond, bionic_mutex_t *mutex)
+{
+	return native_cond_wait(cond, mutex, false, NULL);
+}
+
+static int cond_timedwait(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *abs_timeout)
+{
+	bool use_realtime_clock = !(__atomic_load_n(&cond->__private[0], __ATOMIC_RELAXED) & COND_CLOCK_MONOTONIC_MASK);
+	return native_cond_wait(cond, mutex, use_realtime_clock, abs_timeout);
+}
+
+static int cond_timedwait_monotonic(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *abstime)
+{
+	return native_cond_wait(cond, mutex, false, abstime);
+}
+#else
 static void default_pthread_cond_init(bionic_cond_t *cond)
 {
 	assert(cond);
-	cond->glibc = mmap(NULL, sizeof(*cond->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	memset(cond->glibc, 0, sizeof(*cond->glibc));
+	PUBLISH_GLIBC(cond, glibc_peek(&cond->glibc), slab_alloc());
+}
+
+static inline pthread_cond_t *glibc_cond(bionic_cond_t *cond)
+{
+	if (COND_IS_EMBEDDED(cond))
+		return (pthread_cond_t *)cond;
+	return INIT_IF_NOT_INITIALIZED(cond, default_pthread_cond_init) ? GLIBC(cond) : NULL;
 }
 
 int bionic_pthread_cond_destroy(bionic_cond_t *cond)
 {
 	assert(cond);
+	if (COND_IS_EMBEDDED(cond))
+		return pthread_cond_destroy((pthread_cond_t *)cond);
+
 	int ret = 0;
-	if (IS_MAPPED(cond)) {
-		ret = pthread_cond_destroy(cond->glibc);
-		munmap(cond->glibc, sizeof(*cond->glibc));
+	if (IS_INITIALIZED(cond)) {
+		ret = pthread_cond_destroy(GLIBC(cond));
+		slab_free(GLIBC(cond));
+		cond->glibc = NULL;
 	}
 	return ret;
 }
 
 int bionic_pthread_cond_init(bionic_cond_t *cond, const bionic_condattr_t *attr)
 {
-	// SUS // assert(cond && (!attr || IS_MAPPED(attr)));
+	// SUS // assert(cond && (!attr || IS_INITIALIZED(attr)));
 	// From PTHREAD_COND_INIT(3)
 	// Attempting to initialize an already initialized mutex result in undefined behavior.
 	*cond = (bionic_cond_t){0};
-	cond->glibc = mmap(NULL, sizeof(*cond->glibc), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	return pthread_cond_init(cond->glibc, (attr ? attr->glibc : NULL));
+	if (!COND_IS_EMBEDDED(cond)) {
+		pthread_cond_t *glibc = slab_alloc();
+		if (!glibc)
+			return ENOMEM;
+		SET_GLIBC(cond, glibc);
+	}
+	return pthread_cond_init(glibc_cond(cond), (attr ? GLIBC(attr) : NULL));
 }
 
 int bionic_pthread_cond_broadcast(bionic_cond_t *cond)
 {
 	assert(cond);
-	INIT_IF_NOT_MAPPED(cond, default_pthread_cond_init);
-	return pthread_cond_broadcast(cond->glibc);
+	pthread_cond_t *glibc = glibc_cond(cond);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_cond_broadcast(glibc);
 }
 
 int bionic_pthread_cond_signal(bionic_cond_t *cond)
 {
 	assert(cond);
-	INIT_IF_NOT_MAPPED(cond, default_pthread_cond_init);
-	return pthread_cond_signal(cond->glibc);
+	pthread_cond_t *glibc = glibc_cond(cond);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_cond_signal(glibc);
+}
+
+static int cond_wait(bionic_cond_t *cond, bionic_mutex_t *mutex)
+{
+	pthread_cond_t *glibc = glibc_cond(cond);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_cond_wait(glibc, glibc_mutex(mutex));
 }
 
+static int cond_timedwait(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *abs_timeout)
+{
+	pthread_cond_t *glibc = glibc_cond(cond);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_cond_timedwait(glibc, glibc_mutex(mutex), abs_timeout);
+}
+
+static int cond_timedwait_monotonic(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *abstime)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 30)
+	pthread_cond_t *glibc = glibc_cond(cond);
+	if (unlikely(!glibc))
+		return EAGAIN;
+	return pthread_cond_clockwait(glibc, glibc_mutex(mutex), CLOCK_MONOTONIC, abstime);
+#else
+	// no way to pick the clock for a single wait, so go by how long is left
+	struct timespec now, left;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left.tv_sec = abstime->tv_sec - now.tv_sec;
+	left.tv_nsec = abstime->tv_nsec - now.tv_nsec;
+	if (left.tv_nsec < 0) {
+		--left.tv_sec;
+		left.tv_nsec += 1000000000;
+	}
+	if (left.tv_sec < 0)
+		left = (struct timespec){0};
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	timespec_add(&now, &left);
+	return cond_timedwait(cond, mutex, &now);
+#endif
+}
+#endif
+
 int
 bionic_pthread_cond_wait(bionic_cond_t *cond, bionic_mutex_t *mutex) {
 	assert(cond && mutex);
-	INIT_IF_NOT_MAPPED(cond, default_pthread_cond_init);
-	INIT_IF_NOT_MAPPED(mutex, default_pthread_mutex_init);
-	return pthread_cond_wait(cond->glibc, mutex->glibc);
+	return LOCK_PROFILE_WAIT(LOCK_PROFILE_COND, cond, cond_wait(cond, mutex));
 }
 
 int bionic_pthread_cond_timedwait(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *abs_timeout)
 {
 	assert(cond && mutex);
-	INIT_IF_NOT_MAPPED(cond, default_pthread_cond_init);
-	INIT_IF_NOT_MAPPED(mutex, default_pthread_mutex_init);
-	return pthread_cond_timedwait(cond->glibc, mutex->glibc, abs_timeout);
+	return LOCK_PROFILE_WAIT(LOCK_PROFILE_COND, cond, cond_timedwait(cond, mutex, abs_timeout));
 }
 
+// bionic's relative and monotonic waits are both on CLOCK_MONOTONIC, whatever
+// clock the cond itself was set up with
+
 int bionic_pthread_cond_timedwait_relative_np(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *reltime)
 {
 	assert(cond && mutex && reltime);
 	struct timespec tv;
-	clock_gettime(CLOCK_REALTIME, &tv);
-	tv.tv_sec += reltime->tv_sec;
-	tv.tv_nsec += reltime->tv_nsec;
-	if (tv.tv_nsec >= 1000000000) {
-		++tv.tv_sec;
-		tv.tv_nsec -= 1000000000;
-	}
-	return bionic_pthread_cond_timedwait(cond, mutex, &tv);
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	timespec_add(&tv, reltime);
+	return LOCK_PROFILE_WAIT(LOCK_PROFILE_COND, cond, cond_timedwait_monotonic(cond, mutex, &tv));
 }
 
 int bionic_pthread_cond_timedwait_monotonic_np(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *abstime)
 {
 	assert(cond && mutex && abstime);
-	struct timespec tv;
-	clock_gettime(CLOCK_MONOTONIC, &tv);
-	tv.tv_sec += abstime->tv_sec;
-	tv.tv_nsec += abstime->tv_nsec;
-	if (tv.tv_nsec >= 1000000000) {
-		++tv.tv_sec;
-		tv.tv_nsec -= 1000000000;
-	}
-	return bionic_pthread_cond_timedwait(cond, mutex, &tv);
+	return LOCK_PROFILE_WAIT(LOCK_PROFILE_COND, cond, cond_timedwait_monotonic(cond, mutex, abstime));
 }
 
 int bionic_pthread_cond_timedwait_monotonic(bionic_cond_t *cond, bionic_mutex_t *mutex, const struct timespec *abstime)
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a thread created through bionic's pthread_create(), see
+ * pthread_get_thread_stats() */
+struct pthread_thread_stats {
+	pid_t tid;
+	/* the thread that created it */
+	pid_t parent;
+	void *(*start_routine)(void *);
+	/* on CLOCK_REALTIME */
+	struct timespec created;
+	/* CPU time used so far, from the thread's CLOCK_THREAD_CPUTIME_ID */
+	struct timespec cpu_time;
+	/* the attributes asked for when it was created; a stack size of 0 is
+	 * the default one */
+	size_t stack_size;
+	int detached;
+	int sched_policy;
+	int sched_priority;
+};
+
+/* fills in up to `count` entries of `size` bytes each, so that callers built
+ * against an older version of struct pthread_thread_stats keep working;
+ * returns the number of threads still running, which may be more */
+size_t pthread_get_thread_stats(struct pthread_thread_stats *stats, size_t size, size_t count);
+/* writes a table of the above to `fd`, with the start routines symbolized */
+void pthread_dump_threads(int fd);
+
+/* what the thread stack cache did (see BIONIC_PTHREAD_STACK_CACHE), see
+ * pthread_get_stack_cache_stats() */
+struct pthread_stack_cache_stats {
+	/* threads created with a stack from the cache, or a new one */
+	unsigned long long hits;
+	unsigned long long misses;
+	/* stacks put in the cache once their thread was joined or gone */
+	unsigned long long released;
+	/* stacks unmapped instead, because the cache was full */
+	unsigned long long evicted;
+	/* what's in the cache right now */
+	size_t cached_stacks;
+	size_t cached_bytes;
+};
+
+/* fills in up to `size` bytes of `stats`, like pthread_get_thread_stats() */
+void pthread_get_stack_cache_stats(struct pthread_stack_cache_stats *stats, size_t size);
+
+#ifdef __cplusplus
+}
+#endif